@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <unistd.h>
 #include <stdio.h>
 #include <malloc.h>
@@ -6,260 +7,962 @@
 #include <byteswap.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <string.h>
+#include <errno.h>
 #include "alloc.h"
 
+/*Sizes are rounded to ALIGNMENT, so every small request maps
+  to exactly one size class*/
+#define ALIGNMENT 16
+#define SMALL_BIN_COUNT 64
+#define SMALL_BIN_MAX (SMALL_BIN_COUNT * ALIGNMENT)
+/*Large bins are log spaced, bin i holds sizes in [1024*2^i, 1024*2^(i+1))*/
+#define LARGE_BIN_COUNT 54
+#define BIN_COUNT (SMALL_BIN_COUNT + LARGE_BIN_COUNT)
+#define BINMAP_WORDS ((BIN_COUNT + 63) / 64)
+
+/*Every block starts with a header, the data follows directly.
+  Free blocks also store their size at the end of the data (boundary tag),
+  so the previous block can be found from the header of the next one*/
 typedef struct memory_block
 {
-    void *start_address;
-    bool free;
-    uint32_t size;
-    struct memory_block *next_block;
-    struct memory_block *prev_block;
+    size_t size;
+    uint32_t magic;
+    uint32_t flags;
+    /*Neighbours in the bin, only valid while the block is free*/
+    struct memory_block *next_free;
+    struct memory_block *prev_free;
 
 } memory_block_t;
 
-memory_block_t mem_start;
+#define HEADER_SIZE offsetof(memory_block_t, next_free)
+/*Free list links and the boundary tag have to fit into a free block*/
+#define MIN_BLOCK_SIZE 32
+#define BLOCK_MAGIC 0xa110c8edu
+#define BLOCK_FREE 1u
+#define PREV_FREE 2u
+/*Block is used from the allocators view but sits in a thread cache*/
+#define BLOCK_CACHED 4u
+/*Block has its own mapping and is not part of a segment*/
+#define BLOCK_MMAPPED 8u
+/*The pages inside a free block were already given back*/
+#define BLOCK_TRIMMED 16u
+
+/*Requests of at least MMAP_THRESHOLD bytes get their own mapping.
+  Free blocks of at least TRIM_THRESHOLD bytes have their pages released,
+  which is done once TRIM_INTERVAL bytes were freed since the last time*/
+#ifndef MMAP_THRESHOLD
+#define MMAP_THRESHOLD (64 * 1024)
+#endif
+#ifndef TRIM_THRESHOLD
+#define TRIM_THRESHOLD (64 * 1024)
+#endif
+#ifndef TRIM_INTERVAL
+#define TRIM_INTERVAL (256 * 1024)
+#endif
+
+/*Every thread keeps recently freed blocks of up to TCACHE_MAX_SIZE bytes
+  in singly linked lists per size class, which are used without locking*/
+#define TCACHE_MAX_SIZE (32 * 1024)
+#define TCACHE_CLASSES (SMALL_BIN_COUNT + 4 * 5)
+#define TCACHE_COUNT 32
+#define TCACHE_BYTES (64 * 1024)
+
+_Static_assert(ALLOC_STATS_CLASSES == TCACHE_CLASSES + 1, "one histogram class per cache class and one for larger requests");
+
+/*Counters are kept per thread, so the lock free paths do not share cache lines*/
+typedef struct thread_counters
+{
+    uint64_t mallocs;
+    uint64_t frees;
+    uint64_t cache_hits;
+    uint64_t class_allocations[ALLOC_STATS_CLASSES];
+} thread_counters_t;
+
+typedef struct thread_cache
+{
+    memory_block_t *entries[TCACHE_CLASSES];
+    uint32_t counts[TCACHE_CLASSES];
+    size_t cached_bytes;
+    thread_counters_t counters;
+    /*List of all registered caches, used for the statistics*/
+    struct thread_cache *next_cache;
+    struct thread_cache *prev_cache;
+    bool registered;
+} thread_cache_t;
+
+/*Memory obtained by sbrk is organized in segments,
+  a new segment is started if the break was moved by somebody else.
+  Every segment ends with an epilogue header of size 0 that is never free*/
+typedef struct heap_segment
+{
+    struct heap_segment *next;
+    size_t size;
+} heap_segment_t;
+
+#define SEGMENT_OVERHEAD (sizeof(heap_segment_t) + 2 * HEADER_SIZE)
+/*Smallest piece of memory that holds a segment with one block*/
+#define MIN_SEGMENT_PIECE (SEGMENT_OVERHEAD + MIN_BLOCK_SIZE + ALIGNMENT)
+
+/*Segments start aligned and all sizes are multiples of ALIGNMENT,
+  so every returned pointer is aligned as well*/
+_Static_assert(ALIGNMENT == ALLOC_ALIGNMENT, "alignment has to match the header");
+_Static_assert(HEADER_SIZE % ALIGNMENT == 0, "header breaks the alignment");
+_Static_assert(sizeof(heap_segment_t) % ALIGNMENT == 0, "segment header breaks the alignment");
+
+heap_segment_t *segments;
+heap_segment_t *top_segment;
+memory_block_t *bins[BIN_COUNT];
+/*One bit per bin, set if the bin is not empty*/
+uint64_t binmap[BINMAP_WORDS];
+size_t untrimmed_bytes;
 pthread_mutex_t memory_lock = PTHREAD_MUTEX_INITIALIZER;
 
-void *_malloc(size_t size)
+/*Statistics, except for mmapped_bytes only changed with memory_lock held*/
+size_t heap_size;
+size_t heap_used;
+size_t free_bytes;
+uint64_t heap_searches;
+uint64_t search_steps;
+uint64_t lock_acquisitions;
+uint64_t lock_contentions;
+size_t mmapped_bytes;
+thread_cache_t *caches;
+/*Counters of threads that already exited*/
+thread_counters_t retired_counters;
+
+static inline void lock_heap()
 {
-    pthread_mutex_lock(&memory_lock);
-    if (size == 0)
-        return NULL;
-    if (mem_start.start_address == NULL)
+    if (pthread_mutex_trylock(&memory_lock) != 0)
     {
-        void *start = sbrk(0);
-        if(start == (void*)-1){
-            pthread_mutex_unlock(&memory_lock);
-            return NULL;
-        }
-        mem_start.start_address = start;
-        void *new_end = sbrk(size);
-        mem_start.free = false;
-        mem_start.size = size;
-        pthread_mutex_unlock(&memory_lock);
-        return start;
+        pthread_mutex_lock(&memory_lock);
+        lock_contentions++;
+    }
+    lock_acquisitions++;
+}
+
+static inline void unlock_heap()
+{
+    pthread_mutex_unlock(&memory_lock);
+}
+
+static inline void *block_data(memory_block_t *b)
+{
+    return (char *)b + HEADER_SIZE;
+}
+
+static inline memory_block_t *data_block(void *ptr)
+{
+    return (memory_block_t *)((char *)ptr - HEADER_SIZE);
+}
+
+static inline memory_block_t *next_block(memory_block_t *b)
+{
+    return (memory_block_t *)((char *)block_data(b) + b->size);
+}
+
+/*Only valid if PREV_FREE is set*/
+static inline memory_block_t *prev_block(memory_block_t *b)
+{
+    size_t prev_size = *((size_t *)b - 1);
+    return (memory_block_t *)((char *)b - prev_size - HEADER_SIZE);
+}
+
+static inline void *segment_end(heap_segment_t *s)
+{
+    return (char *)s + s->size;
+}
+
+static inline void set_free(memory_block_t *b)
+{
+    b->flags |= BLOCK_FREE;
+    *((size_t *)next_block(b) - 1) = b->size;
+    next_block(b)->flags |= PREV_FREE;
+}
+
+static inline void set_used(memory_block_t *b)
+{
+    b->flags &= ~(BLOCK_FREE | BLOCK_TRIMMED);
+    next_block(b)->flags &= ~PREV_FREE;
+}
+
+static inline void init_block(memory_block_t *b, size_t size, uint32_t flags)
+{
+    b->size = size;
+    b->magic = BLOCK_MAGIC;
+    b->flags = flags;
+}
+
+/*Larger requests would wrap around when they are rounded to a block or a mapping*/
+static inline bool too_large(size_t size)
+{
+    if (size <= SIZE_MAX - ALIGNMENT - HEADER_SIZE - (size_t)getpagesize())
+        return false;
+    errno = ENOMEM;
+    return true;
+}
+
+static inline size_t round_size(size_t size)
+{
+    size = (size + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1);
+    return size < MIN_BLOCK_SIZE ? MIN_BLOCK_SIZE : size;
+}
+
+static inline uint32_t bin_index(size_t size)
+{
+    if (size <= SMALL_BIN_MAX)
+        return size / ALIGNMENT - 1;
+    uint32_t log = 63 - __builtin_clzll(size);
+    uint32_t i = SMALL_BIN_COUNT + log - __builtin_ctz(SMALL_BIN_MAX);
+    return i < BIN_COUNT ? i : BIN_COUNT - 1;
+}
+
+static void bin_insert(memory_block_t *b)
+{
+    uint32_t i = bin_index(b->size);
+    b->prev_free = NULL;
+    b->next_free = bins[i];
+    if (bins[i] != NULL)
+        bins[i]->prev_free = b;
+    bins[i] = b;
+    binmap[i / 64] |= 1ULL << (i % 64);
+    free_bytes += b->size;
+}
+
+static void bin_remove(memory_block_t *b)
+{
+    uint32_t i = bin_index(b->size);
+    if (b->prev_free != NULL)
+        b->prev_free->next_free = b->next_free;
+    else
+        bins[i] = b->next_free;
+    if (b->next_free != NULL)
+        b->next_free->prev_free = b->prev_free;
+    if (bins[i] == NULL)
+        binmap[i / 64] &= ~(1ULL << (i % 64));
+    free_bytes -= b->size;
+}
+
+/*Returns the first non empty bin with an index >= i or BIN_COUNT*/
+static uint32_t next_bin(uint32_t i)
+{
+    for (uint32_t w = i / 64; w < BINMAP_WORDS; w++)
+    {
+        uint64_t bits = binmap[w];
+        if (w == i / 64)
+            bits &= ~0ULL << (i % 64);
+        if (bits)
+            return w * 64 + __builtin_ctzll(bits);
     }
-    else if (mem_start.free)
+    return BIN_COUNT;
+}
+
+/*Finds a free block of at least size bytes
+  Small bins hold blocks of exactly one size, so only large bins
+  need to be searched, every bin above the requested one fits*/
+static memory_block_t *find_block(size_t size)
+{
+    uint32_t i = bin_index(size);
+    heap_searches++;
+    if (i >= SMALL_BIN_COUNT)
     {
-        /*First element exists and is not taken*/
-        if (mem_start.next_block == NULL)
+        for (memory_block_t *b = bins[i]; b != NULL; b = b->next_free)
         {
-
-            /*Increase/Decrease first block to new size*/
-            void* test = sbrk(size - mem_start.size);
-            if(test == (void*)-1){
-                pthread_mutex_unlock(&memory_lock);
-                return NULL;
-            }
-            mem_start.size = size;
-            mem_start.free = false;
-            pthread_mutex_unlock(&memory_lock);
-            return mem_start.start_address;
+            search_steps++;
+            if (b->size >= size)
+                return b;
         }
-        else if (size <= mem_start.size)
-        {
-            /*First block can be used for new allocation
-             It is either being split up or used as is*/
+        i++;
+    }
+    search_steps++;
+    i = next_bin(i);
+    return i < BIN_COUNT ? bins[i] : NULL;
+}
 
-            if (mem_start.size > size + sizeof(memory_block_t))
-            {
+/*Splits b at size and puts the remainder into its bin*/
+static void split_block(memory_block_t *b, size_t size)
+{
+    if (b->size < size + HEADER_SIZE + MIN_BLOCK_SIZE)
+        return;
 
-                memory_block_t *new_block = mem_start.start_address + size;
-                new_block->free = true;
-                new_block->next_block = mem_start.next_block;
-                new_block->prev_block = &mem_start;
-                new_block->size = mem_start.size - size - sizeof(memory_block_t);
-                new_block->start_address = new_block;
-                mem_start.next_block->prev_block = new_block;
-                mem_start.next_block = new_block;
-                mem_start.size = size;
-                mem_start.free = false;
-                pthread_mutex_unlock(&memory_lock);
-                return mem_start.start_address;
-            }
-            else
-            {
-                mem_start.free = false;
-                pthread_mutex_unlock(&memory_lock);
-                return mem_start.start_address;
-            }
-        }
+    memory_block_t *new_block = (memory_block_t *)((char *)block_data(b) + size);
+    init_block(new_block, b->size - size - HEADER_SIZE, 0);
+    b->size = size;
+    set_free(new_block);
+    bin_insert(new_block);
+}
+
+/*Turns a fresh piece of memory into a segment holding one block. The block is used
+  and holds at least size bytes or, with size 0, is free and put into its bin.
+  Returns NULL if the piece is too small*/
+static memory_block_t *add_segment(char *p, size_t length, size_t size)
+{
+    size_t pad = (ALIGNMENT - (uintptr_t)p % ALIGNMENT) % ALIGNMENT;
+    if (length < pad + SEGMENT_OVERHEAD + (size != 0 ? size : MIN_BLOCK_SIZE))
+        return NULL;
+
+    heap_segment_t *s = (heap_segment_t *)(p + pad);
+    /*The epilogue and any remainder split off have to stay aligned*/
+    s->size = (length - pad) & ~(size_t)(ALIGNMENT - 1);
+    s->next = segments;
+    segments = s;
+    top_segment = s;
+    heap_size += s->size;
+
+    memory_block_t *b = (memory_block_t *)(s + 1);
+    init_block(b, s->size - SEGMENT_OVERHEAD, 0);
+    init_block(next_block(b), 0, 0);
+    if (size == 0)
+    {
+        set_free(b);
+        bin_insert(b);
+        return b;
     }
+    split_block(b, size);
+    return b;
+}
 
-    /*First block is not empty
-      traversing the list of blocks*/
-    memory_block_t *m = &mem_start;
-    for (; m->next_block != NULL; m = m->next_block)
+/*Grows the heap by at least one block of size bytes*/
+static memory_block_t *extend_heap(size_t size)
+{
+    char *brk = sbrk(0);
+    if (top_segment != NULL && brk == segment_end(top_segment))
     {
-        if (m->next_block->free)
+        /*The epilogue becomes the header of the new block,
+          a free block in front of it is grown instead*/
+        memory_block_t *b = (memory_block_t *)(brk - HEADER_SIZE);
+        size_t grow = size + HEADER_SIZE;
+        if (b->flags & PREV_FREE)
         {
-            if (m->next_block->size >= size)
-            {
-                if (m->next_block->size > size + sizeof(memory_block_t))
-                {
-                    memory_block_t *new_block = m->next_block->start_address + sizeof(memory_block_t) + size;
-                    new_block->free = true;
-                    new_block->next_block = m->next_block->next_block;
-                    new_block->prev_block = m->next_block;
-                    new_block->size = m->next_block->size - size - sizeof(memory_block_t);
-                    new_block->start_address = new_block;
-                    if (m->next_block->next_block != NULL)
-                        m->next_block->next_block->prev_block = new_block;
-                    m->next_block->next_block = new_block;
-                    m->next_block->size = size;
-                }
-
-                m->next_block->free = false;
-                pthread_mutex_unlock(&memory_lock);
-                return m->next_block->start_address + sizeof(memory_block_t);
-            }
+            b = prev_block(b);
+            grow = size - b->size;
+        }
+        /*Enough for a segment of its own in case the memory is not contiguous,
+          more than needed is split off again*/
+        size_t extra = grow < MIN_SEGMENT_PIECE ? MIN_SEGMENT_PIECE - grow : 0;
+        grow += extra;
+        char *p = sbrk(grow);
+        if (p == (void *)-1)
+            return NULL;
+        if (p == brk)
+        {
+            if (b->flags & BLOCK_FREE)
+                bin_remove(b);
+            top_segment->size += grow;
+            heap_size += grow;
+            init_block(b, size + extra, 0);
+            init_block(next_block(b), 0, 0);
+            split_block(b, size);
+            return b;
         }
+        /*Break was moved in between, the new memory is not contiguous.
+          A piece too small for the block is kept as a free segment*/
+        memory_block_t *n = add_segment(p, grow, size);
+        if (n != NULL)
+            return n;
+        add_segment(p, grow, 0);
     }
 
-    /*No emtpy block with sufficant size was found*/
+    size_t length = size + SEGMENT_OVERHEAD + ALIGNMENT;
+    char *p = sbrk(length);
+    if (p == (void *)-1)
+        return NULL;
+    return add_segment(p, length, size);
+}
 
-    /*Last block can be increased in size */
-    if (m->free)
+/*Takes a block of size bytes from the heap, memory_lock has to be held*/
+static memory_block_t *heap_malloc(size_t size)
+{
+    memory_block_t *b = find_block(size);
+    if (b != NULL)
     {
-        void* test = sbrk(size - m->size);
-        if(test == (void*)-1){
-            pthread_mutex_unlock(&memory_lock);
+        bin_remove(b);
+        split_block(b, size);
+    }
+    else
+    {
+        /*No emtpy block with sufficant size was found*/
+        b = extend_heap(size);
+        if (b == NULL)
             return NULL;
+    }
+    set_used(b);
+    heap_used += b->size;
+    return b;
+}
+
+/*Releases the pages inside all large free blocks with madvise,
+  the bin links at the start and the boundary tag at the end are kept*/
+static void trim_free_blocks()
+{
+    uintptr_t page = getpagesize();
+    for (uint32_t i = bin_index(TRIM_THRESHOLD); i < BIN_COUNT; i = next_bin(i + 1))
+    {
+        for (memory_block_t *b = bins[i]; b != NULL; b = b->next_free)
+        {
+            if (b->size < TRIM_THRESHOLD || (b->flags & BLOCK_TRIMMED))
+                continue;
+            uintptr_t start = ((uintptr_t)&b->prev_free + sizeof(b->prev_free) + page - 1) & ~(page - 1);
+            uintptr_t end = ((uintptr_t)next_block(b) - sizeof(size_t)) & ~(page - 1);
+            if (end > start)
+                madvise((void *)start, end - start, MADV_DONTNEED);
+            b->flags |= BLOCK_TRIMMED;
         }
-        m->size = size;
-        m->free = false;
-        pthread_mutex_unlock(&memory_lock);
-        return m->start_address + sizeof(memory_block_t);
     }
+    untrimmed_bytes = 0;
+}
 
-    /*New block needs to be appended*/
-    memory_block_t *new_block = sbrk(size + sizeof(memory_block_t));
-    if(new_block == (void*)-1){
-        pthread_mutex_unlock(&memory_lock);
-        return NULL;
+/*Gives a used block back to the heap, memory_lock has to be held*/
+static void heap_free(memory_block_t *b)
+{
+    untrimmed_bytes += b->size;
+    heap_used -= b->size;
+
+    /*Combining empty neighbours, the epilogue is never free*/
+    memory_block_t *n = next_block(b);
+    if (n->flags & BLOCK_FREE)
+    {
+        bin_remove(n);
+        n->magic = 0;
+        b->size += HEADER_SIZE + n->size;
+    }
+    if (b->flags & PREV_FREE)
+    {
+        memory_block_t *p = prev_block(b);
+        bin_remove(p);
+        b->magic = 0;
+        p->size += HEADER_SIZE + b->size;
+        p->flags &= ~BLOCK_TRIMMED;
+        b = p;
+    }
+
+    /*Give a large block back to the system if it is the last one of the heap*/
+    n = next_block(b);
+    if (b->size >= TRIM_THRESHOLD && segment_end(top_segment) == (char *)n + HEADER_SIZE && sbrk(0) == segment_end(top_segment))
+    {
+        size_t shrink = HEADER_SIZE + b->size;
+        init_block(b, 0, 0);
+        top_segment->size -= shrink;
+        heap_size -= shrink;
+        sbrk(-(intptr_t)shrink);
+        return;
     }
-    new_block->size = size;
-    new_block->free = false;
-    new_block->prev_block = m;
-    new_block->next_block = NULL;
-    new_block->start_address = new_block;
-    new_block->prev_block->next_block = new_block;
-    pthread_mutex_unlock(&memory_lock);
 
-    return ((void *)new_block) + sizeof(memory_block_t);
+    set_free(b);
+    bin_insert(b);
+    /*Free blocks in the middle of the heap keep their address space,
+      but do not use physical memory anymore*/
+    if (untrimmed_bytes >= TRIM_INTERVAL)
+        trim_free_blocks();
 }
 
-void _free(void *ptr)
+/*Cache classes are the small size classes and 4 classes per power of two
+  above them. Sizes below TCACHE_MAX_SIZE are rounded up to their class,
+  so every cached block can serve every request of its class*/
+static inline uint32_t cache_class(size_t size)
+{
+    if (size <= SMALL_BIN_MAX)
+        return size / ALIGNMENT - 1;
+    uint32_t log = 63 - __builtin_clzll(size - 1);
+    uint32_t sub = (size - 1 - (1ULL << log)) >> (log - 2);
+    return SMALL_BIN_COUNT + (log - __builtin_ctz(SMALL_BIN_MAX)) * 4 + sub;
+}
+
+static inline size_t class_size(uint32_t c)
+{
+    if (c < SMALL_BIN_COUNT)
+        return (c + 1) * ALIGNMENT;
+    uint32_t log = __builtin_ctz(SMALL_BIN_MAX) + (c - SMALL_BIN_COUNT) / 4;
+    return (1ULL << log) + (((c - SMALL_BIN_COUNT) % 4 + 1) << (log - 2));
+}
+
+static inline uint32_t cache_limit(uint32_t c)
+{
+    uint32_t limit = TCACHE_BYTES / class_size(c);
+    if (limit > TCACHE_COUNT)
+        return TCACHE_COUNT;
+    return limit < 2 ? 2 : limit;
+}
+
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+static __thread thread_cache_t tcache;
+
+/*Returns count blocks of class c from the cache to the heap*/
+static void tcache_flush(thread_cache_t *cache, uint32_t c, uint32_t count)
+{
+    lock_heap();
+    for (; count > 0 && cache->entries[c] != NULL; count--)
+    {
+        memory_block_t *b = cache->entries[c];
+        cache->entries[c] = b->next_free;
+        cache->counts[c]--;
+        cache->cached_bytes -= b->size;
+        b->flags &= ~BLOCK_CACHED;
+        heap_free(b);
+    }
+    unlock_heap();
+}
+
+static void tcache_destroy(void *arg)
+{
+    thread_cache_t *cache = arg;
+    for (uint32_t c = 0; c < TCACHE_CLASSES; c++)
+        tcache_flush(cache, c, cache->counts[c]);
+
+    lock_heap();
+    retired_counters.mallocs += cache->counters.mallocs;
+    retired_counters.frees += cache->counters.frees;
+    retired_counters.cache_hits += cache->counters.cache_hits;
+    for (uint32_t c = 0; c < ALLOC_STATS_CLASSES; c++)
+        retired_counters.class_allocations[c] += cache->counters.class_allocations[c];
+    cache->counters = (thread_counters_t){0};
+    if (cache->prev_cache != NULL)
+        cache->prev_cache->next_cache = cache->next_cache;
+    else
+        caches = cache->next_cache;
+    if (cache->next_cache != NULL)
+        cache->next_cache->prev_cache = cache->prev_cache;
+    cache->registered = false;
+    unlock_heap();
+}
+
+static void tcache_init_key()
+{
+    pthread_key_create(&tcache_key, tcache_destroy);
+}
+
+/*Registers the cache of the calling thread, so it is flushed on exit*/
+static inline void tcache_register()
+{
+    if (tcache.registered)
+        return;
+    pthread_once(&tcache_once, tcache_init_key);
+    pthread_setspecific(tcache_key, &tcache);
+    lock_heap();
+    tcache.prev_cache = NULL;
+    tcache.next_cache = caches;
+    if (caches != NULL)
+        caches->prev_cache = &tcache;
+    caches = &tcache;
+    unlock_heap();
+    tcache.registered = true;
+}
+
+static inline void tcache_push(memory_block_t *b, uint32_t c)
+{
+    b->flags |= BLOCK_CACHED;
+    b->next_free = tcache.entries[c];
+    tcache.entries[c] = b;
+    tcache.counts[c]++;
+    tcache.cached_bytes += b->size;
+}
+
+/*Takes half a cache worth of blocks from the heap with one lock,
+  the first one is returned, the others are cached*/
+static memory_block_t *tcache_refill(uint32_t c)
+{
+    size_t size = class_size(c);
+    uint32_t count = cache_limit(c) / 2;
+    lock_heap();
+    memory_block_t *r = heap_malloc(size);
+    for (uint32_t i = 1; r != NULL && i < count; i++)
+    {
+        memory_block_t *b = heap_malloc(size);
+        if (b == NULL)
+            break;
+        tcache_push(b, c);
+    }
+    unlock_heap();
+    return r;
+}
+
+/*Large blocks are mapped on their own and unmapped again on free,
+  so they never pin any other memory*/
+static void *mmap_malloc(size_t size, size_t alignment)
+{
+    uintptr_t page = getpagesize();
+    size_t extra = alignment > ALIGNMENT ? alignment : 0;
+    size_t length = (size + HEADER_SIZE + extra + page - 1) & ~(page - 1);
+    char *base = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED)
+        return NULL;
+
+    /*Pages in front of the header and behind the data are not needed*/
+    uintptr_t data = ((uintptr_t)base + HEADER_SIZE + alignment - 1) & ~(uintptr_t)(alignment - 1);
+    uintptr_t start = (data - HEADER_SIZE) & ~(page - 1);
+    uintptr_t end = (data + size + page - 1) & ~(page - 1);
+    if (start > (uintptr_t)base)
+        munmap(base, start - (uintptr_t)base);
+    if ((uintptr_t)base + length > end)
+        munmap((void *)end, (uintptr_t)base + length - end);
+
+    memory_block_t *b = data_block((void *)data);
+    __atomic_fetch_add(&mmapped_bytes, end - start, __ATOMIC_RELAXED);
+    init_block(b, end - data, BLOCK_MMAPPED);
+    return block_data(b);
+}
+
+/*The mapping starts at the page of the header*/
+static void mmap_free(memory_block_t *b)
 {
-    pthread_mutex_lock(&memory_lock);
-    /*Do nothing if no memory was allocated or NULL*/
-    if (mem_start.start_address == NULL || ptr == NULL){
-        pthread_mutex_unlock(&memory_lock);
+    uintptr_t start = (uintptr_t)b & ~(uintptr_t)(getpagesize() - 1);
+    size_t length = (uintptr_t)block_data(b) + b->size - start;
+    __atomic_fetch_sub(&mmapped_bytes, length, __ATOMIC_RELAXED);
+    munmap((void *)start, length);
+}
+
+/*Gives the end of a used block starting at size bytes back to the heap,
+  memory_lock has to be held*/
+static void shrink_block(memory_block_t *b, size_t size)
+{
+    if (b->size < size + HEADER_SIZE + MIN_BLOCK_SIZE)
         return;
+
+    memory_block_t *r = (memory_block_t *)((char *)block_data(b) + size);
+    init_block(r, b->size - size - HEADER_SIZE, 0);
+    b->size = size;
+    heap_used -= HEADER_SIZE;
+    heap_free(r);
+}
+
+static memory_block_t *checked_block(void *ptr)
+{
+    memory_block_t *b = data_block(ptr);
+    if (b->magic != BLOCK_MAGIC || (b->flags & (BLOCK_FREE | BLOCK_CACHED)))
+    {
+        fprintf(stderr, "Invalid Pointer\n");
+        exit(-1);
     }
-    if (ptr == mem_start.start_address)
+    return b;
+}
+
+void *_malloc(size_t size)
+{
+    if (size == 0 || too_large(size))
+        return NULL;
+    size = round_size(size);
+    tcache_register();
+    tcache.counters.mallocs++;
+
+    if (size <= TCACHE_MAX_SIZE)
     {
-        if (mem_start.next_block == NULL)
+        uint32_t c = cache_class(size);
+        tcache.counters.class_allocations[c]++;
+        memory_block_t *b = tcache.entries[c];
+        if (b != NULL)
         {
-            sbrk(-mem_start.size);
-            mem_start.start_address = NULL;
-            mem_start.size = 0;
-            mem_start.free = false;
-            pthread_mutex_unlock(&memory_lock);
-            return;            
+            tcache.entries[c] = b->next_free;
+            tcache.counts[c]--;
+            tcache.cached_bytes -= b->size;
+            tcache.counters.cache_hits++;
         }
         else
         {
-            mem_start.free = true;
+            b = tcache_refill(c);
+            if (b == NULL)
+                return NULL;
         }
+        b->flags &= ~BLOCK_CACHED;
+        return block_data(b);
     }
-    else
+
+    tcache.counters.class_allocations[ALLOC_STATS_CLASSES - 1]++;
+    if (size >= MMAP_THRESHOLD)
+        return mmap_malloc(size, ALIGNMENT);
+
+    lock_heap();
+    memory_block_t *b = heap_malloc(size);
+    unlock_heap();
+    return b != NULL ? block_data(b) : NULL;
+}
+
+void _free(void *ptr)
+{
+    /*Do nothing if NULL*/
+    if (ptr == NULL)
+        return;
+
+    memory_block_t *b = checked_block(ptr);
+    tcache_register();
+    tcache.counters.frees++;
+
+    if (b->flags & BLOCK_MMAPPED)
+    {
+        mmap_free(b);
+        return;
+    }
+
+    /*Recently freed blocks stay in the cache of the thread,
+      a full cache is emptied halfway in one batch.
+      Blocks that were not split can be slightly larger than their class*/
+    if (b->size < TCACHE_MAX_SIZE + HEADER_SIZE + MIN_BLOCK_SIZE)
+    {
+        uint32_t c = cache_class(b->size);
+        if (class_size(c) > b->size)
+            c--;
+        if (tcache.counts[c] >= cache_limit(c))
+            tcache_flush(&tcache, c, cache_limit(c) / 2);
+        tcache_push(b, c);
+        return;
+    }
+
+    lock_heap();
+    heap_free(b);
+    unlock_heap();
+}
+
+void *_calloc(size_t count, size_t size)
+{
+    size_t total;
+    if (__builtin_mul_overflow(count, size, &total))
+        return NULL;
+    void *ptr = _malloc(total);
+    if (ptr == NULL)
+        return NULL;
+    /*Fresh mappings are already zeroed*/
+    if (!(data_block(ptr)->flags & BLOCK_MMAPPED))
+        memset(ptr, 0, total);
+    return ptr;
+}
+
+void *_realloc(void *ptr, size_t size)
+{
+    if (ptr == NULL)
+        return _malloc(size);
+    if (size == 0)
+    {
+        _free(ptr);
+        return NULL;
+    }
+
+    memory_block_t *b = checked_block(ptr);
+    if (too_large(size))
+        return NULL;
+    size_t new_size = round_size(size);
+    if (new_size <= b->size && !(b->flags & BLOCK_MMAPPED))
+    {
+        lock_heap();
+        shrink_block(b, new_size);
+        unlock_heap();
+        return ptr;
+    }
+
+    if (b->flags & BLOCK_MMAPPED)
     {
-        int found = false;
-        for (memory_block_t *m = mem_start.next_block; m != NULL; m = m->next_block)
+        if (new_size <= b->size)
+            return ptr;
+        /*Mappings with the default alignment can be moved by the kernel*/
+        uintptr_t page = getpagesize();
+        if (((uintptr_t)b & (page - 1)) == 0)
         {
-            if (m->start_address + sizeof(memory_block_t) == ptr)
-            {
-                m->free = true;
-                found = true;
-                break;
-            }
+            size_t old_length = b->size + HEADER_SIZE;
+            size_t new_length = (new_size + HEADER_SIZE + page - 1) & ~(page - 1);
+            memory_block_t *n = mremap(b, old_length, new_length, MREMAP_MAYMOVE);
+            if (n == MAP_FAILED)
+                return NULL;
+            __atomic_fetch_add(&mmapped_bytes, new_length - old_length, __ATOMIC_RELAXED);
+            n->size = new_length - HEADER_SIZE;
+            return block_data(n);
         }
-        if(!found){
-            fprintf(stderr,"Invalid Pointer\n");
-            exit(-1);
+    }
+    else
+    {
+        /*Grow into a free successor or at the end of the heap*/
+        lock_heap();
+        memory_block_t *n = next_block(b);
+        if ((n->flags & BLOCK_FREE) && b->size + HEADER_SIZE + n->size >= new_size)
+        {
+            bin_remove(n);
+            n->magic = 0;
+            heap_used += HEADER_SIZE + n->size;
+            b->size += HEADER_SIZE + n->size;
+            next_block(b)->flags &= ~PREV_FREE;
+            shrink_block(b, new_size);
+            unlock_heap();
+            return ptr;
         }
-
-        /*Combining empty memory blocks*/
-        int prev_free = false;
-
-        for (memory_block_t *m = mem_start.next_block; m != NULL; m = m->next_block)
+        char *brk = sbrk(0);
+        /*Sizes that _malloc maps stay out of the heap*/
+        if (new_size < MMAP_THRESHOLD && n->size == 0 && (char *)n + HEADER_SIZE == brk && brk == segment_end(top_segment))
         {
-            if (m->free)
+            size_t grow = new_size - b->size;
+            if (sbrk(grow) == brk)
             {
-                if (prev_free)
-                {
-                    memory_block_t *prev_block = m->prev_block;
-                    prev_block->size += sizeof(memory_block_t) + m->size;
-                    prev_block->next_block = m->next_block;
-                    if (m->next_block != NULL)
-                    {
-                        m->next_block->prev_block = prev_block;
-                    }
-                }
-                prev_free = true;
+                top_segment->size += grow;
+                heap_size += grow;
+                heap_used += grow;
+                b->size = new_size;
+                init_block(next_block(b), 0, 0);
+                unlock_heap();
+                return ptr;
             }
-            else
-                prev_free = false;
         }
+        unlock_heap();
+    }
 
-        /*Free last block if empty*/
-        memory_block_t *l = mem_start.next_block;
-        for (; l->next_block != NULL; l = l->next_block);
-        
-        if (l->free)
-        {
-            l->prev_block->next_block = NULL;
-            sbrk(-l->size - sizeof(memory_block_t));
-        }
+    void *r = _malloc(size);
+    if (r == NULL)
+        return NULL;
+    memcpy(r, ptr, b->size < size ? b->size : size);
+    _free(ptr);
+    return r;
+}
+
+void *_aligned_alloc(size_t alignment, size_t size)
+{
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0)
+        return NULL;
+    if (alignment <= ALIGNMENT)
+        return _malloc(size);
+    if (size == 0)
+        return NULL;
+    /*The heap takes alignment more bytes, a mapping up to alignment more*/
+    size_t padded;
+    if (__builtin_add_overflow(size, alignment, &padded))
+        padded = SIZE_MAX;
+    if (too_large(padded))
+        return NULL;
+
+    size = round_size(size);
+    tcache_register();
+    tcache.counters.mallocs++;
+    tcache.counters.class_allocations[size <= TCACHE_MAX_SIZE ? cache_class(size) : ALLOC_STATS_CLASSES - 1]++;
+    if (size + alignment >= MMAP_THRESHOLD)
+        return mmap_malloc(size, alignment);
+
+    /*Enough space is taken to place a free block in front of the aligned one*/
+    lock_heap();
+    memory_block_t *b = heap_malloc(size + alignment + HEADER_SIZE + MIN_BLOCK_SIZE);
+    if (b == NULL)
+    {
+        unlock_heap();
+        return NULL;
     }
+    uintptr_t data = (uintptr_t)block_data(b);
+    uintptr_t aligned = (data + alignment - 1) & ~(uintptr_t)(alignment - 1);
+    if (aligned != data)
+    {
+        if (aligned - data < HEADER_SIZE + MIN_BLOCK_SIZE)
+            aligned += alignment;
+        memory_block_t *a = data_block((void *)aligned);
+        init_block(a, b->size - (aligned - data), 0);
+        b->size = aligned - data - HEADER_SIZE;
+        heap_used -= HEADER_SIZE;
+        heap_free(b);
+        b = a;
+    }
+    shrink_block(b, size);
+    unlock_heap();
+    return block_data(b);
+}
+
+int _posix_memalign(void **ptr, size_t alignment, size_t size)
+{
+    if (alignment % sizeof(void *) != 0 || (alignment & (alignment - 1)) != 0)
+        return EINVAL;
+    void *r = _aligned_alloc(alignment, size);
+    if (r == NULL && size != 0)
+        return ENOMEM;
+    *ptr = r;
+    return 0;
+}
+
+/*Counters of running threads are read without synchronization,
+  so they might be slightly outdated*/
+void alloc_get_stats(alloc_stats_t *stats)
+{
+    *stats = (alloc_stats_t){0};
+    thread_counters_t counters = {0};
+    size_t cached_bytes = 0;
 
-    if (mem_start.free)
+    lock_heap();
+    stats->heap_size = heap_size;
+    stats->bytes_free = free_bytes;
+    stats->heap_searches = heap_searches;
+    stats->lock_acquisitions = lock_acquisitions;
+    stats->lock_contentions = lock_contentions;
+    stats->mmapped_bytes = __atomic_load_n(&mmapped_bytes, __ATOMIC_RELAXED);
+    uint32_t largest_bin = BIN_COUNT;
+    for (uint32_t i = next_bin(0); i < BIN_COUNT; i = next_bin(i + 1))
+        largest_bin = i;
+    if (largest_bin < BIN_COUNT)
     {
-        /*Free all memory if first block is last one */
-        // fprintf(stderr,"%d\n",mem_start.next_block->free);
-        if (mem_start.next_block == NULL)
+        for (memory_block_t *b = bins[largest_bin]; b != NULL; b = b->next_free)
         {
-            sbrk(-mem_start.size);
-            mem_start.start_address = NULL;
-            mem_start.size = 0;
-            mem_start.free = false;
+            if (b->size > stats->largest_free_block)
+                stats->largest_free_block = b->size;
         }
-        else
-            /*Add all free blocks after the first one to the first one */
-            if (mem_start.next_block->free)
-            {
-                // exit(0);
-                mem_start.size += mem_start.next_block->size + sizeof(memory_block_t);
-                if (mem_start.next_block->next_block != NULL)
-                {
-                    mem_start.next_block->next_block->prev_block = &mem_start;
-                }
-                mem_start.next_block = mem_start.next_block->next_block;
-            }
     }
 
-    pthread_mutex_unlock(&memory_lock);
+    counters = retired_counters;
+    for (thread_cache_t *cache = caches; cache != NULL; cache = cache->next_cache)
+    {
+        counters.mallocs += cache->counters.mallocs;
+        counters.frees += cache->counters.frees;
+        counters.cache_hits += cache->counters.cache_hits;
+        for (uint32_t c = 0; c < ALLOC_STATS_CLASSES; c++)
+            counters.class_allocations[c] += cache->counters.class_allocations[c];
+        cached_bytes += cache->cached_bytes;
+    }
+    stats->bytes_in_use = heap_used - cached_bytes + stats->mmapped_bytes;
+    stats->bytes_cached = cached_bytes;
+    uint64_t steps = search_steps;
+    unlock_heap();
+
+    stats->malloc_calls = counters.mallocs;
+    stats->free_calls = counters.frees;
+    stats->cache_hits = counters.cache_hits;
+    for (uint32_t c = 0; c < ALLOC_STATS_CLASSES; c++)
+    {
+        stats->class_allocations[c] = counters.class_allocations[c];
+        stats->class_sizes[c] = c < TCACHE_CLASSES ? class_size(c) : SIZE_MAX;
+    }
+    if (stats->bytes_free > 0)
+        stats->fragmentation = 1.0 - (double)stats->largest_free_block / stats->bytes_free;
+    if (stats->malloc_calls > 0)
+        stats->average_search_length = (double)steps / stats->malloc_calls;
+}
+
+void alloc_print_stats(FILE *f)
+{
+    alloc_stats_t s;
+    alloc_get_stats(&s);
+    fprintf(f, "Heap size (sbrk):     %zu\n", s.heap_size);
+    fprintf(f, "Mapped (mmap):        %zu\n", s.mmapped_bytes);
+    fprintf(f, "Bytes in use:         %zu\n", s.bytes_in_use);
+    fprintf(f, "Bytes in caches:      %zu\n", s.bytes_cached);
+    fprintf(f, "Bytes free:           %zu\n", s.bytes_free);
+    fprintf(f, "Largest free block:   %zu\n", s.largest_free_block);
+    fprintf(f, "Fragmentation:        %.3f\n", s.fragmentation);
+    fprintf(f, "Malloc/free calls:    %lu/%lu\n", s.malloc_calls, s.free_calls);
+    fprintf(f, "Thread cache hits:    %lu\n", s.cache_hits);
+    fprintf(f, "Heap searches:        %lu\n", s.heap_searches);
+    fprintf(f, "Avg. search length:   %.3f\n", s.average_search_length);
+    fprintf(f, "Lock acquisitions:    %lu (contended %lu)\n", s.lock_acquisitions, s.lock_contentions);
+    fprintf(f, "Allocations per size class:\n");
+    for (uint32_t c = 0; c < ALLOC_STATS_CLASSES; c++)
+    {
+        if (s.class_allocations[c] == 0)
+            continue;
+        if (s.class_sizes[c] == SIZE_MAX)
+            fprintf(f, "  > %zu: %lu\n", s.class_sizes[c - 1], s.class_allocations[c]);
+        else
+            fprintf(f, "  <= %zu: %lu\n", s.class_sizes[c], s.class_allocations[c]);
+    }
 }
 
 void print_memory_layout()
 {
-    memory_block_t *m = &mem_start;
     int i = 0;
-    for (; m != NULL; m = m->next_block)
+    for (heap_segment_t *s = segments; s != NULL; s = s->next)
     {
-        fprintf(stderr, "Block %d: {size: %u, is_free: %d }\n", i++, m->size, m->free);
+        for (memory_block_t *m = (memory_block_t *)(s + 1); m->size != 0; m = next_block(m))
+        {
+            fprintf(stderr, "Block %d: {size: %zu, is_free: %d, is_trimmed: %d }\n", i++, m->size, (m->flags & BLOCK_FREE) != 0, (m->flags & BLOCK_TRIMMED) != 0);
+        }
     }
 }
 #define malloc(x) _malloc(x)
@@ -9,11 +9,51 @@
 #include <stdint.h>
 
 
+/*Every pointer returned by the allocator is aligned to at least ALLOC_ALIGNMENT bytes*/
+#define ALLOC_ALIGNMENT 16
+
+/*One class per thread cache class and one for larger requests*/
+#define ALLOC_STATS_CLASSES 85
+
+typedef struct alloc_stats
+{
+    size_t heap_size;
+    size_t mmapped_bytes;
+    size_t bytes_in_use;
+    size_t bytes_cached;
+    size_t bytes_free;
+    size_t largest_free_block;
+    /*1 - largest free block / free bytes*/
+    double fragmentation;
+    uint64_t malloc_calls;
+    uint64_t free_calls;
+    uint64_t cache_hits;
+    uint64_t heap_searches;
+    /*Free blocks looked at per _malloc*/
+    double average_search_length;
+    uint64_t lock_acquisitions;
+    uint64_t lock_contentions;
+    /*Allocations up to class_sizes[i] bytes, the last class holds everything larger*/
+    size_t class_sizes[ALLOC_STATS_CLASSES];
+    uint64_t class_allocations[ALLOC_STATS_CLASSES];
+} alloc_stats_t;
+
 void *_malloc(size_t size);
 void _free(void *ptr);
+void *_calloc(size_t count, size_t size);
+/*Grows into a free successor block if possible before moving the data*/
+void *_realloc(void *ptr, size_t size);
+void *_aligned_alloc(size_t alignment, size_t size);
+int _posix_memalign(void **ptr, size_t alignment, size_t size);
 void print_memory_layout();
+void alloc_get_stats(alloc_stats_t *stats);
+void alloc_print_stats(FILE *f);
 
 #define malloc(x) _malloc(x)
 #define free(x) _free(x)
+#define calloc(n, x) _calloc(n, x)
+#define realloc(p, x) _realloc(p, x)
+#define aligned_alloc(a, x) _aligned_alloc(a, x)
+#define posix_memalign(p, a, x) _posix_memalign(p, a, x)
 
 #endif
\ No newline at end of file
@@ -0,0 +1,286 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <stdatomic.h>
+#include "exchange.h"
+#ifdef USECUSTOMMALLOC
+#include "alloc.h"
+#endif
+
+/*
+Benchmark for malloc and free replaying the allocation patterns of the server.
+Every pattern runs in its own process, so the peak RSS belongs to that pattern only.
+*/
+
+#define DEFAULT_OPS 200000
+#define DEFAULT_THREADS 4
+#define CONTENTION_THREADS 32
+#define WORKING_SET 4096
+#define QUEUE_SIZE 1024
+/*Every n-th call is timed*/
+#define SAMPLE_RATE 4
+
+/*Value sizes stored by the clients, the test uses 1024 integers*/
+static const uint32_t value_sizes[] = {1024 * sizeof(int), 64, 256, MAX_TRANSMISSION_SIZE * sizeof(uint32_t)};
+
+typedef struct bench_thread
+{
+    uint32_t id;
+    uint32_t ops;
+    uint64_t done;
+    uint32_t sample_count;
+    uint32_t *samples;
+    struct bench_thread *partner;
+    /*Used by the producer/consumer pattern*/
+    void **queue;
+    _Atomic uint32_t head;
+    _Atomic uint32_t tail;
+} bench_thread_t;
+
+typedef struct bench_result
+{
+    double ops_per_sec;
+    uint32_t p50;
+    uint32_t p99;
+} bench_result_t;
+
+typedef void *(*pattern_function)(void *);
+
+static inline uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*Samples are stored outside of the allocator under test*/
+static uint32_t *alloc_samples(uint32_t count)
+{
+    uint32_t *s = mmap(NULL, count * sizeof(uint32_t), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return s == MAP_FAILED ? NULL : s;
+}
+
+static inline void *timed_malloc(bench_thread_t *b, size_t size)
+{
+    if (b->done++ % SAMPLE_RATE != 0)
+        return malloc(size);
+    uint64_t start = now_ns();
+    void *p = malloc(size);
+    b->samples[b->sample_count++] = now_ns() - start;
+    return p;
+}
+
+static inline void timed_free(bench_thread_t *b, void *ptr)
+{
+    if (b->done++ % SAMPLE_RATE != 0)
+    {
+        free(ptr);
+        return;
+    }
+    uint64_t start = now_ns();
+    free(ptr);
+    b->samples[b->sample_count++] = now_ns() - start;
+}
+
+/*Insert, read and delete of one server thread:
+  value copy on insert, chain node per collision and temporary copy on read*/
+void *server_pattern(void *args)
+{
+    bench_thread_t *b = args;
+    uint32_t count = b->ops / 6;
+    void **values = malloc(sizeof(void *) * count);
+    void **nodes = malloc(sizeof(void *) * count);
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        values[i] = timed_malloc(b, value_sizes[i % 4]);
+        memset(values[i], i, 64);
+        nodes[i] = timed_malloc(b, 32);
+    }
+    for (uint32_t i = 0; i < count; i++)
+    {
+        uint32_t j = count - i - 1;
+        void *r = timed_malloc(b, value_sizes[j % 4]);
+        memcpy(r, values[j], 64);
+        timed_free(b, r);
+    }
+    for (uint32_t i = 0; i < count; i++)
+    {
+        timed_free(b, values[i]);
+        timed_free(b, nodes[i]);
+    }
+    free(values);
+    free(nodes);
+    return NULL;
+}
+
+/*Random sizes up to 8 KiB replacing random elements of a working set*/
+void *churn_pattern(void *args)
+{
+    bench_thread_t *b = args;
+    unsigned int seed = b->id + 1;
+    void **set = calloc(WORKING_SET, sizeof(void *));
+    for (uint32_t i = 0; i < b->ops / 2; i++)
+    {
+        uint32_t slot = rand_r(&seed) % WORKING_SET;
+        if (set[slot] != NULL)
+            timed_free(b, set[slot]);
+        set[slot] = timed_malloc(b, 16 + rand_r(&seed) % 8192);
+    }
+    for (uint32_t i = 0; i < WORKING_SET; i++)
+    {
+        if (set[i] != NULL)
+            free(set[i]);
+    }
+    free(set);
+    return NULL;
+}
+
+/*Even threads allocate, odd threads free what their partner allocated*/
+void *producer_consumer_pattern(void *args)
+{
+    bench_thread_t *b = args;
+    uint32_t count = b->ops / 2;
+    if (b->id % 2 == 0)
+    {
+        for (uint32_t i = 0; i < count; i++)
+        {
+            void *p = timed_malloc(b, 64 + (i % 16) * 64);
+            while (atomic_load_explicit(&b->tail, memory_order_relaxed) - atomic_load_explicit(&b->head, memory_order_acquire) == QUEUE_SIZE)
+                sched_yield();
+            uint32_t tail = atomic_load_explicit(&b->tail, memory_order_relaxed);
+            b->queue[tail % QUEUE_SIZE] = p;
+            atomic_store_explicit(&b->tail, tail + 1, memory_order_release);
+        }
+    }
+    else
+    {
+        bench_thread_t *p = b->partner;
+        for (uint32_t i = 0; i < count; i++)
+        {
+            uint32_t head = atomic_load_explicit(&p->head, memory_order_relaxed);
+            while (atomic_load_explicit(&p->tail, memory_order_acquire) == head)
+                sched_yield();
+            void *ptr = p->queue[head % QUEUE_SIZE];
+            atomic_store_explicit(&p->head, head + 1, memory_order_release);
+            timed_free(b, ptr);
+        }
+    }
+    return NULL;
+}
+
+/*Tight malloc/free pairs of small sizes on many threads*/
+void *contention_pattern(void *args)
+{
+    bench_thread_t *b = args;
+    for (uint32_t i = 0; i < b->ops / 2; i++)
+    {
+        void *p = timed_malloc(b, 16 << (i % 6));
+        timed_free(b, p);
+    }
+    return NULL;
+}
+
+static int compare_samples(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+static bench_result_t run_pattern(pattern_function f, uint32_t threads, uint32_t ops)
+{
+    bench_thread_t *b = mmap(NULL, sizeof(bench_thread_t) * threads, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    pthread_t t[threads];
+    for (uint32_t i = 0; i < threads; i++)
+    {
+        b[i] = (bench_thread_t){.id = i, .ops = ops};
+        b[i].samples = alloc_samples(ops / SAMPLE_RATE + 2);
+        b[i].queue = (void **)alloc_samples(QUEUE_SIZE * 2);
+        b[i].partner = &b[i - i % 2];
+    }
+
+    uint64_t start = now_ns();
+    for (uint32_t i = 0; i < threads; i++)
+        pthread_create(&t[i], NULL, f, &b[i]);
+    for (uint32_t i = 0; i < threads; i++)
+        pthread_join(t[i], NULL);
+    uint64_t elapsed = now_ns() - start;
+
+    uint64_t done = 0;
+    uint32_t sample_count = 0;
+    for (uint32_t i = 0; i < threads; i++)
+    {
+        done += b[i].done;
+        sample_count += b[i].sample_count;
+    }
+    uint32_t *all = alloc_samples(sample_count + 1);
+    for (uint32_t i = 0, n = 0; i < threads; i++)
+    {
+        memcpy(all + n, b[i].samples, b[i].sample_count * sizeof(uint32_t));
+        n += b[i].sample_count;
+    }
+    qsort(all, sample_count, sizeof(uint32_t), compare_samples);
+
+    bench_result_t r = {.ops_per_sec = done / (elapsed / 1e9)};
+    if (sample_count > 0)
+    {
+        r.p50 = all[sample_count / 2];
+        r.p99 = all[(uint64_t)sample_count * 99 / 100];
+    }
+    return r;
+}
+
+/*Runs the pattern in a child process and reports its peak RSS*/
+static void bench(const char *name, pattern_function f, uint32_t threads, uint32_t ops)
+{
+    int fd[2];
+    if (pipe(fd) != 0)
+        return;
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        close(fd[0]);
+        bench_result_t r = run_pattern(f, threads, ops);
+        write(fd[1], &r, sizeof(r));
+        _exit(0);
+    }
+    close(fd[1]);
+    bench_result_t r = {0};
+    ssize_t n = read(fd[0], &r, sizeof(r));
+    close(fd[0]);
+    struct rusage usage;
+    int status;
+    wait4(pid, &status, 0, &usage);
+    if (n != sizeof(r))
+    {
+        fprintf(stderr, "%s failed\n", name);
+        return;
+    }
+    printf("%-18s %8u %14.0f %10u %10u %12ld\n", name, threads, r.ops_per_sec, r.p50, r.p99, usage.ru_maxrss);
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t ops = DEFAULT_OPS;
+    uint32_t threads = DEFAULT_THREADS;
+    if (argc > 1)
+        ops = strtoul(argv[1], NULL, 10);
+    if (argc > 2)
+        threads = strtoul(argv[2], NULL, 10);
+    threads += threads % 2;
+
+    printf("%-18s %8s %14s %10s %10s %12s\n", "pattern", "threads", "ops/sec", "p50 (ns)", "p99 (ns)", "peak RSS (KiB)");
+    bench("server", server_pattern, threads, ops);
+    bench("random-churn", churn_pattern, threads, ops);
+    bench("producer-consumer", producer_consumer_pattern, threads, ops);
+    bench("contention", contention_pattern, CONTENTION_THREADS, ops / 8);
+    return 0;
+}
@@ -0,0 +1,91 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include "arena.h"
+
+static inline bool page_used(arena_t *a, uint32_t page)
+{
+    return a->map[page / 64] & (1ULL << (page % 64));
+}
+
+static void mark_pages(arena_t *a, uint32_t first, uint32_t pages, bool used)
+{
+    for (uint32_t page = first; page < first + pages; page++)
+    {
+        if (used)
+            a->map[page / 64] |= 1ULL << (page % 64);
+        else
+            a->map[page / 64] &= ~(1ULL << (page % 64));
+    }
+}
+
+static void lock_arena(arena_t *a)
+{
+    /*The map of a client that died while holding the lock at most leaks pages*/
+    if (pthread_mutex_lock(&a->lock) == EOWNERDEAD)
+        pthread_mutex_consistent(&a->lock);
+}
+
+size_t arena_size(uint32_t page_count)
+{
+    return sizeof(arena_t) + (page_count + 63) / 64 * sizeof(uint64_t);
+}
+
+void arena_init(arena_t *a, uint32_t page_count)
+{
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&a->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    a->page_count = page_count;
+    a->free_pages = page_count;
+    memset(a->map, 0, (page_count + 63) / 64 * sizeof(uint64_t));
+}
+
+uint32_t arena_alloc(arena_t *a, uint32_t pages, uint32_t *got)
+{
+    uint32_t best = ARENA_NONE, best_length = 0;
+    lock_arena(a);
+    /*First fit, remembering the longest run in case no run is long enough*/
+    for (uint32_t page = 0; page < a->page_count && best_length < pages && a->free_pages > 0;)
+    {
+        if (a->map[page / 64] == UINT64_MAX)
+        {
+            page = (page / 64 + 1) * 64;
+            continue;
+        }
+        if (page_used(a, page))
+        {
+            page++;
+            continue;
+        }
+        uint32_t length = 0;
+        while (page + length < a->page_count && length < pages && !page_used(a, page + length))
+            length++;
+        if (length > best_length)
+        {
+            best = page;
+            best_length = length;
+        }
+        page += length;
+    }
+    if (best != ARENA_NONE)
+    {
+        mark_pages(a, best, best_length, true);
+        a->free_pages -= best_length;
+    }
+    pthread_mutex_unlock(&a->lock);
+    *got = best_length;
+    return best;
+}
+
+void arena_free(arena_t *a, uint32_t first, uint32_t pages)
+{
+    lock_arena(a);
+    mark_pages(a, first, pages, false);
+    a->free_pages += pages;
+    pthread_mutex_unlock(&a->lock);
+}
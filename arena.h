@@ -0,0 +1,40 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+/*
+Payload arena in shared memory. The pages are shared by all slots, a client takes
+a run of pages for its requests and gives it back when it exits, so a slot only
+holds as much memory as its requests need. Taking and giving back pages is rare,
+so the page map is guarded by a robust mutex.
+*/
+
+/*Bytes per page, a multiple of the cache line size*/
+#ifndef ARENA_PAGE
+#define ARENA_PAGE 512
+#endif
+#define ARENA_NONE UINT32_MAX
+
+typedef struct arena
+{
+    pthread_mutex_t lock;
+    uint32_t page_count;
+    uint32_t free_pages;
+    /*One bit per page, set if the page is used*/
+    uint64_t map[];
+} arena_t;
+
+/*Size of the arena header with the map for page_count pages*/
+size_t arena_size(uint32_t page_count);
+
+void arena_init(arena_t *a, uint32_t page_count);
+
+/*Takes a run of up to pages pages, the largest free run if there is no run of that length.
+  Returns the first page and sets *got to the length of the run, ARENA_NONE if all pages are used*/
+uint32_t arena_alloc(arena_t *a, uint32_t pages, uint32_t *got);
+
+void arena_free(arena_t *a, uint32_t first, uint32_t pages);
+
+#endif
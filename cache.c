@@ -0,0 +1,532 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include "cache.h"
+#include "epoch.h"
+#ifdef USECUSTOMMALLOC
+#include "alloc.h"
+#endif
+
+/*Every stripe has its own lock, keys, hand and share of the budget*/
+#define CACHE_STRIPES 64
+/*Keys the hand looks at per insert while the stripe is over its budget,
+  so no insert pays for evicting a large part of the table*/
+#define CLOCK_STEPS 8
+#define STRIPE_MIN_KEYS 16
+
+typedef struct cached_key
+{
+    uint32_t key;
+    /*Entries of the key in the table, 0 for a free slot*/
+    uint32_t entries;
+    uint64_t bytes;
+    /*Milliseconds of CLOCK_MONOTONIC_COARSE, 0 if the key does not expire*/
+    _Atomic uint64_t expires;
+    /*Set by reads and inserts, cleared by the hand*/
+    _Atomic bool referenced;
+} cached_key_t;
+
+/*The keys are an open addressing table with linear probing,
+  the hand and the sweep go round the same array. Reads look keys up without
+  the lock, seq changes whenever keys are added, moved or the array is replaced*/
+typedef struct stripe
+{
+    pthread_mutex_t lock;
+    _Atomic uint32_t seq;
+    cached_key_t *keys;
+    uint32_t capacity;
+    uint32_t used;
+    uint32_t hand;
+    uint32_t sweep;
+    uint64_t bytes;
+    uint64_t evicted;
+    uint64_t expired;
+} __attribute__((aligned(64))) stripe_t;
+
+typedef struct cache
+{
+    const table_engine_t *base;
+    void *table;
+    /*0 without a budget*/
+    uint64_t stripe_budget;
+    uint32_t ttl;
+    stripe_t stripes[CACHE_STRIPES];
+} cache_t;
+
+/*The low bits of the hash pick the stripe, the high bits the slot*/
+static inline stripe_t *stripe_of(cache_t *c, uint64_t hash)
+{
+    return &c->stripes[hash % CACHE_STRIPES];
+}
+
+static inline uint32_t home_slot(stripe_t *s, uint64_t hash)
+{
+    return (hash >> 32) & (s->capacity - 1);
+}
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static inline bool expired(const cached_key_t *k, uint64_t now)
+{
+    uint64_t expires = atomic_load_explicit(&k->expires, memory_order_relaxed);
+    return expires != 0 && expires <= now;
+}
+
+/*Returns when key expires without the lock of the stripe, 0 if it does not expire or
+  is not in the stripe. A touched key is marked as referenced*/
+static uint64_t lookup_key(stripe_t *s, uint32_t key, uint64_t hash, bool touch)
+{
+    epoch_enter();
+    for (;;)
+    {
+        uint32_t seq = atomic_load_explicit(&s->seq, memory_order_acquire);
+        if (seq & 1)
+            continue;
+        /*keys is replaced before capacity grows, so the array is never smaller than capacity*/
+        uint32_t mask = __atomic_load_n(&s->capacity, __ATOMIC_ACQUIRE) - 1;
+        cached_key_t *keys = __atomic_load_n(&s->keys, __ATOMIC_RELAXED);
+        cached_key_t *k = NULL;
+        for (uint32_t i = (hash >> 32) & mask, n = 0; n <= mask; i = (i + 1) & mask, n++)
+        {
+            if (__atomic_load_n(&keys[i].entries, __ATOMIC_RELAXED) == 0)
+                break;
+            if (__atomic_load_n(&keys[i].key, __ATOMIC_RELAXED) == key)
+            {
+                k = &keys[i];
+                break;
+            }
+        }
+        uint64_t expires = k != NULL ? atomic_load_explicit(&k->expires, memory_order_relaxed) : 0;
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&s->seq, memory_order_relaxed) != seq)
+            continue;
+        /*A key moved meanwhile leaves the mark on another key, which only costs that key a round*/
+        if (k != NULL && touch)
+            atomic_store_explicit(&k->referenced, true, memory_order_relaxed);
+        epoch_exit();
+        return expires;
+    }
+}
+
+static void free_keys(void *ctx, void *ptr)
+{
+    free(ptr);
+}
+
+static int64_t find_key(stripe_t *s, uint32_t key, uint64_t hash)
+{
+    uint32_t mask = s->capacity - 1;
+    for (uint32_t i = home_slot(s, hash);; i = (i + 1) & mask)
+    {
+        if (s->keys[i].entries == 0)
+            return -1;
+        if (s->keys[i].key == key)
+            return i;
+    }
+}
+
+/*Doubles the keys of the stripe, the stripe keeps its size if there is no memory*/
+static bool grow_stripe(stripe_t *s)
+{
+    uint32_t capacity = s->capacity * 2;
+    cached_key_t *keys = calloc(capacity, sizeof(cached_key_t));
+    if (keys == NULL)
+        return false;
+    for (uint32_t i = 0; i < s->capacity; i++)
+    {
+        if (s->keys[i].entries == 0)
+            continue;
+        uint32_t j = (hash_key(s->keys[i].key) >> 32) & (capacity - 1);
+        while (keys[j].entries != 0)
+            j = (j + 1) & (capacity - 1);
+        keys[j] = s->keys[i];
+    }
+    begin_write(&s->seq);
+    cached_key_t *old = s->keys;
+    __atomic_store_n(&s->keys, keys, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->capacity, capacity, __ATOMIC_RELEASE);
+    end_write(&s->seq);
+    epoch_retire(old, free_keys, NULL);
+    s->hand &= capacity - 1;
+    s->sweep &= capacity - 1;
+    return true;
+}
+
+static cached_key_t *add_key(stripe_t *s, uint32_t key, uint64_t hash)
+{
+    if ((s->used + 1) * 4 > s->capacity * 3 && !grow_stripe(s))
+        return NULL;
+    uint32_t i = home_slot(s, hash);
+    while (s->keys[i].entries != 0)
+        i = (i + 1) & (s->capacity - 1);
+    begin_write(&s->seq);
+    s->keys[i] = (cached_key_t){.key = key};
+    end_write(&s->seq);
+    s->used++;
+    return &s->keys[i];
+}
+
+/*Moves the following keys back into the free slot, so lookups need no tombstones.
+  The hand and the sweep may skip a moved key for one round*/
+static void remove_slot(stripe_t *s, uint32_t i)
+{
+    uint32_t mask = s->capacity - 1;
+    s->used--;
+    begin_write(&s->seq);
+    for (uint32_t j = (i + 1) & mask; s->keys[j].entries != 0; j = (j + 1) & mask)
+    {
+        /*The key in j may fill i if i lies between its home slot and j*/
+        uint32_t home = home_slot(s, hash_key(s->keys[j].key));
+        if (((j - home) & mask) >= ((j - i) & mask))
+        {
+            s->keys[i] = s->keys[j];
+            i = j;
+        }
+    }
+    s->keys[i].entries = 0;
+    end_write(&s->seq);
+}
+
+/*Deletes all entries of the key in slot i from the table*/
+static void drop_key(cache_t *c, stripe_t *s, uint32_t i)
+{
+    cached_key_t *k = &s->keys[i];
+    while (c->base->delete(c->table, k->key))
+        ;
+    s->bytes -= k->bytes;
+    remove_slot(s, i);
+}
+
+/*Moves the hand over at most steps keys while the stripe is over its budget,
+  free slots are skipped for at most one round. Returns the number of keys evicted*/
+static uint64_t evict(cache_t *c, stripe_t *s, uint32_t steps)
+{
+    uint64_t evicted = 0;
+    if (c->stripe_budget == 0)
+        return 0;
+    for (uint32_t slots = 0; steps > 0 && slots < s->capacity && s->bytes > c->stripe_budget && s->used > 0; slots++)
+    {
+        cached_key_t *k = &s->keys[s->hand];
+        if (k->entries != 0 && !atomic_load_explicit(&k->referenced, memory_order_relaxed))
+        {
+            /*The slot is filled by a following key, so the hand stays*/
+            drop_key(c, s, s->hand);
+            evicted++;
+            steps--;
+            continue;
+        }
+        steps -= k->entries != 0;
+        atomic_store_explicit(&k->referenced, false, memory_order_relaxed);
+        s->hand = (s->hand + 1) & (s->capacity - 1);
+    }
+    s->evicted += evicted;
+    return evicted;
+}
+
+/*Takes the cost of one entry off the key in slot i, the key goes with its last entry*/
+static void release_entry(stripe_t *s, uint32_t i, uint64_t cost)
+{
+    cached_key_t *k = &s->keys[i];
+    cost = cost < k->bytes ? cost : k->bytes;
+    k->bytes -= cost;
+    s->bytes -= cost;
+    /*The last entry goes with the slot, so readers never see a free slot within a probe run*/
+    if (k->entries == 1)
+    {
+        s->bytes -= k->bytes;
+        remove_slot(s, i);
+    }
+    else
+    {
+        k->entries--;
+    }
+}
+
+/*Accounts a new entry of key in the locked stripe. An expired key is removed first,
+  so its old entries do not come back. Returns false if the key cannot be tracked*/
+static bool charge(cache_t *c, stripe_t *s, uint32_t key, uint64_t hash, uint32_t length)
+{
+    int64_t i = find_key(s, key, hash);
+    uint64_t now = c->ttl != 0 ? now_ms() : 0;
+    if (i >= 0 && expired(&s->keys[i], now))
+    {
+        drop_key(c, s, i);
+        s->expired++;
+        i = -1;
+    }
+    cached_key_t *k = i >= 0 ? &s->keys[i] : add_key(s, key, hash);
+    if (k == NULL)
+    {
+        fprintf(stderr, "Could not allocate cache keys, dropping key %u\n", key);
+        return false;
+    }
+    k->entries++;
+    k->bytes += (uint64_t)length + CACHE_ENTRY_COST;
+    atomic_store_explicit(&k->expires, c->ttl != 0 ? now + (uint64_t)c->ttl * 1000 : 0, memory_order_relaxed);
+    atomic_store_explicit(&k->referenced, true, memory_order_relaxed);
+    s->bytes += (uint64_t)length + CACHE_ENTRY_COST;
+    return true;
+}
+
+/*Entries already in a wrapped table are charged as not referenced*/
+static void charge_entry(void *ctx, uint32_t key, const void *value, uint32_t length)
+{
+    cache_t *c = ctx;
+    uint64_t hash = hash_key(key);
+    stripe_t *s = stripe_of(c, hash);
+    pthread_mutex_lock(&s->lock);
+    if (charge(c, s, key, hash, length))
+        atomic_store_explicit(&s->keys[find_key(s, key, hash)].referenced, false, memory_order_relaxed);
+    pthread_mutex_unlock(&s->lock);
+}
+
+void *cache_wrap(const table_engine_t *base, void *table, uint64_t budget, uint32_t ttl)
+{
+    cache_t *c = aligned_alloc(64, sizeof(cache_t));
+    if (c == NULL)
+        return NULL;
+    memset(c, 0, sizeof(cache_t));
+    c->base = base;
+    c->table = table;
+    c->stripe_budget = budget == 0 ? 0 : (budget + CACHE_STRIPES - 1) / CACHE_STRIPES;
+    c->ttl = ttl;
+    for (int i = 0; i < CACHE_STRIPES; i++)
+    {
+        stripe_t *s = &c->stripes[i];
+        pthread_mutex_init(&s->lock, NULL);
+        s->capacity = STRIPE_MIN_KEYS;
+        s->keys = calloc(s->capacity, sizeof(cached_key_t));
+        if (s->keys == NULL)
+        {
+            for (; i >= 0; i--)
+                free(c->stripes[i].keys);
+            free(c);
+            return NULL;
+        }
+    }
+    /*The table is evicted down to the budget once all its entries are known,
+      the base cannot delete while it visits*/
+    base->for_each(table, charge_entry, c);
+    for (int i = 0; i < CACHE_STRIPES; i++)
+    {
+        stripe_t *s = &c->stripes[i];
+        pthread_mutex_lock(&s->lock);
+        while (evict(c, s, CLOCK_STEPS) > 0)
+            ;
+        pthread_mutex_unlock(&s->lock);
+    }
+    return c;
+}
+
+/*The entry is charged first, so an expired key is removed before its new entry is
+  inserted. An entry the base drops is released again*/
+static bool cache_insert(void *table, uint32_t key, const void *data, uint32_t data_length)
+{
+    cache_t *c = table;
+    uint64_t hash = hash_key(key);
+    stripe_t *s = stripe_of(c, hash);
+    pthread_mutex_lock(&s->lock);
+    if (!charge(c, s, key, hash, data_length))
+    {
+        pthread_mutex_unlock(&s->lock);
+        return false;
+    }
+    bool inserted = c->base->insert(c->table, key, data, data_length);
+    if (inserted)
+        evict(c, s, CLOCK_STEPS);
+    else
+        release_entry(s, find_key(s, key, hash), (uint64_t)data_length + CACHE_ENTRY_COST);
+    pthread_mutex_unlock(&s->lock);
+    return inserted;
+}
+
+static bool cache_insert_owned(void *table, uint32_t key, void *data, uint32_t data_length)
+{
+    cache_t *c = table;
+    uint64_t hash = hash_key(key);
+    stripe_t *s = stripe_of(c, hash);
+    pthread_mutex_lock(&s->lock);
+    if (!charge(c, s, key, hash, data_length))
+    {
+        pthread_mutex_unlock(&s->lock);
+        free(data);
+        return false;
+    }
+    bool inserted = c->base->insert_owned(c->table, key, data, data_length);
+    if (inserted)
+        evict(c, s, CLOCK_STEPS);
+    else
+        release_entry(s, find_key(s, key, hash), (uint64_t)data_length + CACHE_ENTRY_COST);
+    pthread_mutex_unlock(&s->lock);
+    return inserted;
+}
+
+/*Reads only take the lock of the stripe to remove the expired key they found*/
+static int64_t cache_read(void *table, uint32_t key, uint32_t offset, void *dest, uint32_t capacity)
+{
+    cache_t *c = table;
+    uint64_t hash = hash_key(key);
+    stripe_t *s = stripe_of(c, hash);
+    uint64_t expires = lookup_key(s, key, hash, true);
+    if (expires != 0 && expires <= now_ms())
+    {
+        /*The key may have been inserted again meanwhile*/
+        pthread_mutex_lock(&s->lock);
+        int64_t i = find_key(s, key, hash);
+        if (i >= 0 && expired(&s->keys[i], now_ms()))
+        {
+            drop_key(c, s, i);
+            s->expired++;
+            pthread_mutex_unlock(&s->lock);
+            return -1;
+        }
+        pthread_mutex_unlock(&s->lock);
+    }
+    return c->base->read(c->table, key, offset, dest, capacity);
+}
+
+/*The length of the entry is read first, read and delete find the same entry of a key*/
+static bool cache_delete(void *table, uint32_t key)
+{
+    cache_t *c = table;
+    uint64_t hash = hash_key(key);
+    stripe_t *s = stripe_of(c, hash);
+    pthread_mutex_lock(&s->lock);
+    int64_t i = find_key(s, key, hash);
+    if (i < 0)
+    {
+        bool found = c->base->delete(c->table, key);
+        pthread_mutex_unlock(&s->lock);
+        return found;
+    }
+    cached_key_t *k = &s->keys[i];
+    if (expired(k, now_ms()))
+    {
+        drop_key(c, s, i);
+        s->expired++;
+        pthread_mutex_unlock(&s->lock);
+        return false;
+    }
+    uint8_t unused;
+    int64_t length = c->base->read(c->table, key, 0, &unused, 0);
+    bool found = c->base->delete(c->table, key);
+    if (found)
+        release_entry(s, i, (length > 0 ? (uint64_t)length : 0) + CACHE_ENTRY_COST);
+    pthread_mutex_unlock(&s->lock);
+    return found;
+}
+
+uint64_t cache_sweep(void *table, uint32_t slots)
+{
+    cache_t *c = table;
+    uint64_t removed = 0;
+    for (int i = 0; i < CACHE_STRIPES; i++)
+    {
+        stripe_t *s = &c->stripes[i];
+        pthread_mutex_lock(&s->lock);
+        uint64_t now = now_ms();
+        for (uint32_t n = 0; c->ttl != 0 && n < slots && s->used > 0; n++)
+        {
+            if (s->keys[s->sweep].entries != 0 && expired(&s->keys[s->sweep], now))
+            {
+                drop_key(c, s, s->sweep);
+                s->expired++;
+                removed++;
+                continue;
+            }
+            s->sweep = (s->sweep + 1) & (s->capacity - 1);
+        }
+        removed += evict(c, s, slots);
+        pthread_mutex_unlock(&s->lock);
+    }
+    return removed;
+}
+
+static uint64_t cache_destroy(void *table)
+{
+    cache_t *c = table;
+    uint64_t count = c->base->destroy(c->table);
+    /*Key arrays replaced by grow_stripe*/
+    epoch_drain();
+    for (int i = 0; i < CACHE_STRIPES; i++)
+    {
+        pthread_mutex_destroy(&c->stripes[i].lock);
+        free(c->stripes[i].keys);
+    }
+    free(c);
+    return count;
+}
+
+typedef struct live_visit
+{
+    cache_t *c;
+    uint64_t now;
+    table_visit_t visit;
+    void *ctx;
+} live_visit_t;
+
+static void visit_live(void *ctx, uint32_t key, const void *value, uint32_t length)
+{
+    live_visit_t *v = ctx;
+    uint64_t hash = hash_key(key);
+    uint64_t expires = lookup_key(stripe_of(v->c, hash), key, hash, false);
+    if (expires == 0 || expires > v->now)
+        v->visit(v->ctx, key, value, length);
+}
+
+/*Skips expired keys nobody removed yet. The stripes are not locked, a writer that holds
+  one may wait for the visit, e.g. while the log is paused for a snapshot*/
+static void cache_for_each(void *table, table_visit_t visit, void *ctx)
+{
+    cache_t *c = table;
+    live_visit_t v = {.c = c, .now = now_ms(), .visit = visit, .ctx = ctx};
+    c->base->for_each(c->table, visit_live, &v);
+}
+
+static void cache_print_stats(void *table, FILE *f)
+{
+    cache_t *c = table;
+    uint64_t keys = 0, bytes = 0, evicted = 0, expired = 0;
+    c->base->print_stats(c->table, f);
+    for (int i = 0; i < CACHE_STRIPES; i++)
+    {
+        stripe_t *s = &c->stripes[i];
+        pthread_mutex_lock(&s->lock);
+        keys += s->used;
+        bytes += s->bytes;
+        evicted += s->evicted;
+        expired += s->expired;
+        pthread_mutex_unlock(&s->lock);
+    }
+    if (c->stripe_budget != 0)
+        fprintf(f, "Cache budget:         %lu bytes (%lu used)\n", c->stripe_budget * CACHE_STRIPES, bytes);
+    else
+        fprintf(f, "Cache bytes:          %lu\n", bytes);
+    fprintf(f, "Cached keys:          %lu\n", keys);
+    fprintf(f, "Evicted keys:         %lu\n", evicted);
+    fprintf(f, "Expired keys:         %lu\n", expired);
+}
+
+/*Tables of this engine are only made by cache_wrap*/
+const table_engine_t cache_engine = {
+    .name = "cache",
+    .create = NULL,
+    .insert = cache_insert,
+    .insert_owned = cache_insert_owned,
+    .read = cache_read,
+    .delete = cache_delete,
+    .destroy = cache_destroy,
+    .for_each = cache_for_each,
+    .print_stats = cache_print_stats,
+};
@@ -0,0 +1,33 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdint.h>
+#include "table.h"
+
+/*
+Memory budget and expiry for a table of another engine. Every entry is charged its
+value length plus CACHE_ENTRY_COST bytes. Keys are split into stripes with their own
+share of the budget, once a stripe is over it inserts evict keys with the CLOCK
+algorithm: a hand goes round the keys of the stripe, a key read or inserted since the
+hand passed it last gets another round, the others are evicted with all their entries.
+A key with a TTL expires that many seconds after its last insert, a read of an expired
+key removes it, cache_sweep removes the ones nobody reads. Evicted and expired keys are
+deleted through the base engine, so a log below the cache records them.
+*/
+
+#define CACHE_ENTRY_COST 64
+
+/*Wraps table, which uses base, in a table of cache_engine that holds at most about
+  budget bytes, 0 for no limit. Keys expire ttl seconds after their last insert, 0 for never.
+  The entries already in table are charged and get the full ttl, keys beyond the budget
+  are evicted right away*/
+void *cache_wrap(const table_engine_t *base, void *table, uint64_t budget, uint32_t ttl);
+
+/*Limits a table of another engine to a memory budget and expires its keys*/
+extern const table_engine_t cache_engine;
+
+/*Looks at up to slots keys of every stripe, removes the expired ones and evicts
+  keys of stripes over the budget. Returns the number of keys removed*/
+uint64_t cache_sweep(void *table, uint32_t slots);
+
+#endif
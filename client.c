@@ -6,66 +6,483 @@
 #include <string.h>
 #include <stdbool.h>
 #include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sched.h>
+#include "ring.h"
+#include "sharedtable.h"
 
 #ifdef USECUSTOMMALLOC
 #include "alloc.h"
 #endif
 
 #define DATALENGTH 1024
+/*Values of the batch test are small, so many fit into one request*/
+#define BATCH_VALUE_LENGTH 16
+#define BATCH_KEY_BASE 0x80000000u
+/*Requests are made visible to the server at least this often*/
+#define RING_BURST 64
 int id;
+m_t *memory;
+/*Tables of the partitions mapped read only, NULL if the server does not share them*/
+shared_table_header_t **tables = NULL;
 
-void insert(void *data, uint32_t key, uint32_t data_length, pthread_cond_t *cond, pthread_mutex_t *cond_mutex, exchange_t *e)
+/*
+Makes sure the slot has a payload of at least bytes, as far as max_words and the free
+pages of the arena allow, and returns it. The pages are kept for the following requests.
+*/
+static uint32_t *reserve_payload(exchange_t *e, uint32_t bytes)
 {
-    pthread_mutex_lock(cond_mutex);
-    memcpy(e->data, data, data_length);
-    e->key = key;
-    e->length = data_length;
-    e->type = REQUEST_INSERT;
+    uint32_t max = memory->max_words * sizeof(uint32_t);
+    bytes = bytes < max ? bytes : max;
+    uint32_t pages = bytes > 0 ? (bytes + ARENA_PAGE - 1) / ARENA_PAGE : 1;
+    while (SLOT_BYTES(e) < bytes || e->capacity == 0)
+    {
+        uint32_t got;
+        uint32_t first = arena_alloc(get_arena(memory), pages, &got);
+        if (first == ARENA_NONE)
+        {
+            /*All pages are used, the current pages have to do*/
+            if (e->capacity > 0)
+                break;
+            usleep(100);
+            continue;
+        }
+        if (got * ARENA_PAGE <= SLOT_BYTES(e))
+        {
+            arena_free(get_arena(memory), first, got);
+            break;
+        }
+        if (e->capacity > 0)
+            arena_free(get_arena(memory), e->payload, SLOT_BYTES(e) / ARENA_PAGE);
+        e->payload = first;
+        e->capacity = got * ARENA_PAGE / sizeof(uint32_t);
+    }
+    return get_payload(memory, e);
+}
 
+/*Sends one request and waits for the answer, cond_mutex has to be held*/
+static void send_request(request_type type, pthread_cond_t *cond, pthread_mutex_t *cond_mutex, exchange_t *e)
+{
+    e->type = type;
     pthread_cond_signal(cond);
+    notify_workers(memory, slot_index(memory, e));
+    /*Busy poll: the server takes cond_mutex to serve the request, so it is given up while spinning*/
+    if (memory->spin > 0)
+    {
+        pthread_mutex_unlock(cond_mutex);
+        for (uint32_t n = 0; n < memory->spin && e->type != NO_REQUEST; n++)
+            cpu_relax();
+        lock_robust(cond_mutex);
+    }
     while (e->type != NO_REQUEST)
     {
-        pthread_cond_wait(cond, cond_mutex);
+        if (pthread_cond_wait(cond, cond_mutex) == EOWNERDEAD)
+            pthread_mutex_consistent(cond_mutex);
+    }
+}
+
+/*Sends a value that is larger than the slot in chunks*/
+void stream_insert(void *data, uint32_t key, uint32_t data_length, pthread_cond_t *cond, pthread_mutex_t *cond_mutex, exchange_t *e)
+{
+    uint32_t *payload = reserve_payload(e, data_length);
+    lock_robust(cond_mutex);
+    for (uint32_t offset = 0; offset < data_length;)
+    {
+        uint32_t chunk = data_length - offset < SLOT_BYTES(e) ? data_length - offset : SLOT_BYTES(e);
+        memcpy(payload, (uint8_t *)data + offset, chunk);
+        e->key = key;
+        e->offset = offset;
+        e->total = data_length;
+        e->length = chunk;
+        send_request(REQUEST_STREAM_INSERT, cond, cond_mutex, e);
+        if (e->length == 0)
+        {
+            fprintf(stderr, "Chunk of key %u was rejected\n", key);
+            break;
+        }
+        offset += chunk;
     }
     pthread_mutex_unlock(cond_mutex);
 }
 
-void mem_read(void *data, uint32_t key, uint32_t data_length, pthread_cond_t *cond, pthread_mutex_t *cond_mutex, exchange_t *e)
+/*Receives a value that is larger than the slot in chunks*/
+void stream_read(void *data, uint32_t key, uint32_t data_length, pthread_cond_t *cond, pthread_mutex_t *cond_mutex, exchange_t *e)
 {
+    uint32_t *payload = reserve_payload(e, data_length);
+    lock_robust(cond_mutex);
+    for (uint32_t offset = 0; offset < data_length;)
+    {
+        e->key = key;
+        e->offset = offset;
+        send_request(REQUEST_STREAM_READ, cond, cond_mutex, e);
+        if (e->total != data_length || e->length == 0)
+        {
+            fprintf(stderr, "Received unexpected data length\n");
+            break;
+        }
+        memcpy((uint8_t *)data + offset, payload, e->length);
+        offset += e->length;
+    }
+    pthread_mutex_unlock(cond_mutex);
+}
 
-    pthread_mutex_lock(cond_mutex);
-    memcpy(e->data, data, data_length);
+void insert(void *data, uint32_t key, uint32_t data_length, pthread_cond_t *cond, pthread_mutex_t *cond_mutex, exchange_t *e)
+{
+    uint32_t *payload = reserve_payload(e, data_length);
+    if (data_length > SLOT_BYTES(e))
+    {
+        stream_insert(data, key, data_length, cond, cond_mutex, e);
+        return;
+    }
+    lock_robust(cond_mutex);
+    memcpy(payload, data, data_length);
     e->key = key;
-    e->type = REQUEST_READ;
-    pthread_cond_signal(cond);
-    while (e->type != NO_REQUEST)
+    e->length = data_length;
+    send_request(REQUEST_INSERT, cond, cond_mutex, e);
+    pthread_mutex_unlock(cond_mutex);
+}
+
+void mem_read(void *data, uint32_t key, uint32_t data_length, pthread_cond_t *cond, pthread_mutex_t *cond_mutex, exchange_t *e)
+{
+    uint32_t *payload = reserve_payload(e, data_length);
+    if (data_length > SLOT_BYTES(e))
     {
-        pthread_cond_wait(cond, cond_mutex);
+        stream_read(data, key, data_length, cond, cond_mutex, e);
+        return;
     }
+
+    lock_robust(cond_mutex);
+    memcpy(payload, data, data_length);
+    e->key = key;
+    send_request(REQUEST_READ, cond, cond_mutex, e);
     if (data_length != e->length)
     {
         fprintf(stderr, "Received unexpected data length\n");
         pthread_mutex_unlock(cond_mutex);
         return;
     }
-    memcpy(data, e->data, e->length);
+    memcpy(data, payload, e->length);
     pthread_mutex_unlock(cond_mutex);
 }
 
+/*Reads key from the table of its partition without a request to the server.
+  Returns false if the value was not found there, it then has to be requested*/
+bool direct_read(void *data, uint32_t key, uint32_t data_length)
+{
+    int64_t length = shared_table_read(tables[key_partition(memory, key)], key, 0, data, data_length);
+    if (length >= 0 && length != data_length)
+        fprintf(stderr, "Received unexpected data length\n");
+    return length >= 0;
+}
+
 void delete(uint32_t key, pthread_cond_t *cond, pthread_mutex_t *cond_mutex, exchange_t *e)
 {
 
-    pthread_mutex_lock(cond_mutex);
+    lock_robust(cond_mutex);
     e->key = key;
-    e->type = REQUEST_DELETE;
-    pthread_cond_signal(cond);
-    while (e->type != NO_REQUEST)
+    send_request(REQUEST_DELETE, cond, cond_mutex, e);
+    pthread_mutex_unlock(cond_mutex);
+}
+
+/*Inserts count values, packing as many as fit into one request*/
+void multi_insert(void **data, uint32_t *keys, uint32_t *data_lengths, uint32_t count, pthread_cond_t *cond, pthread_mutex_t *cond_mutex, exchange_t *e)
+{
+    uint32_t *payload = reserve_payload(e, memory->max_words * sizeof(uint32_t));
+    lock_robust(cond_mutex);
+    for (uint32_t i = 0; i < count;)
     {
-        pthread_cond_wait(cond, cond_mutex);
+        uint32_t n = 0, pos = 0;
+        while (i + n < count && pos + 2 + BATCH_WORDS(data_lengths[i + n]) <= e->capacity)
+        {
+            payload[pos] = keys[i + n];
+            payload[pos + 1] = data_lengths[i + n];
+            memcpy(&payload[pos + 2], data[i + n], data_lengths[i + n]);
+            pos += 2 + BATCH_WORDS(data_lengths[i + n]);
+            n++;
+        }
+        if (n == 0)
+        {
+            fprintf(stderr, "Value of key %u is too large for a batch\n", keys[i]);
+            break;
+        }
+        e->key = n;
+        e->length = pos * sizeof(uint32_t);
+        send_request(REQUEST_MULTI_INSERT, cond, cond_mutex, e);
+        i += n;
     }
     pthread_mutex_unlock(cond_mutex);
 }
 
+/*Reads count values, returns false if a value was missing or had an unexpected length*/
+bool multi_read(void **data, uint32_t *keys, uint32_t *data_lengths, uint32_t count, pthread_cond_t *cond, pthread_mutex_t *cond_mutex, exchange_t *e)
+{
+    bool r = true;
+    uint32_t *payload = reserve_payload(e, memory->max_words * sizeof(uint32_t));
+    lock_robust(cond_mutex);
+    for (uint32_t i = 0; i < count;)
+    {
+        uint32_t n = count - i < e->capacity ? count - i : e->capacity;
+        memcpy(payload, &keys[i], n * sizeof(uint32_t));
+        e->key = n;
+        send_request(REQUEST_MULTI_READ, cond, cond_mutex, e);
+        if (e->key == 0)
+        {
+            fprintf(stderr, "Value of key %u is too large for a batch\n", keys[i]);
+            r = false;
+            break;
+        }
+        for (uint32_t j = 0, pos = 0; j < e->key; j++, i++)
+        {
+            uint32_t length = payload[pos];
+            if (length != data_lengths[i])
+            {
+                fprintf(stderr, "Received unexpected data length\n");
+                r = false;
+            }
+            else
+            {
+                memcpy(data[i], &payload[pos + 1], length);
+            }
+            pos += 1 + (length == BATCH_MISSING ? 0 : BATCH_WORDS(length));
+        }
+    }
+    pthread_mutex_unlock(cond_mutex);
+    return r;
+}
+
+/*Deletes count keys, returns the number of keys that were found*/
+uint32_t multi_delete(uint32_t *keys, uint32_t count, pthread_cond_t *cond, pthread_mutex_t *cond_mutex, exchange_t *e)
+{
+    uint32_t deleted = 0;
+    uint32_t *payload = reserve_payload(e, memory->max_words * sizeof(uint32_t));
+    lock_robust(cond_mutex);
+    for (uint32_t i = 0; i < count;)
+    {
+        uint32_t n = count - i < e->capacity ? count - i : e->capacity;
+        memcpy(payload, &keys[i], n * sizeof(uint32_t));
+        e->key = n;
+        send_request(REQUEST_MULTI_DELETE, cond, cond_mutex, e);
+        deleted += e->length;
+        i += n;
+    }
+    pthread_mutex_unlock(cond_mutex);
+    return deleted;
+}
+
+/*State of a client using the rings of its slot*/
+typedef struct ring_client
+{
+    uint32_t slot;
+    ring_t *submit;
+    ring_t *complete;
+    uint32_t in_flight;
+    bool mismatch;
+    /*Reads copy their value to targets[tag]*/
+    void **targets;
+    uint32_t expected_length;
+} ring_client_t;
+
+/*Handles all completions that arrived so far*/
+static void ring_drain(ring_client_t *c)
+{
+    ring_record_t *r;
+    while ((r = ring_peek(c->complete)) != NULL)
+    {
+        if (r->type == REQUEST_READ)
+        {
+            if (r->length != c->expected_length)
+            {
+                fprintf(stderr, "Received unexpected data length\n");
+                c->mismatch = true;
+            }
+            else
+            {
+                memcpy(c->targets[r->tag], r->data, r->length);
+            }
+        }
+        else if (r->type == REQUEST_INSERT && r->length == BATCH_MISSING)
+        {
+            fprintf(stderr, "Insert of key %u was rejected\n", r->key);
+            c->mismatch = true;
+        }
+        else if (r->type == REQUEST_DELETE && r->length == 0)
+        {
+            fprintf(stderr, "Element %u was not deleted\n", r->key);
+            c->mismatch = true;
+        }
+        ring_consume(c->complete);
+        c->in_flight--;
+    }
+    ring_release(c->complete);
+}
+
+/*Makes the queued requests visible to the server*/
+static void ring_submit(ring_client_t *c)
+{
+    ring_publish(c->submit);
+    notify_workers(memory, c->slot);
+}
+
+/*Queues a request without waiting for its completion.
+  For reads data_length is the size of the buffer targets[tag]*/
+void ring_request(ring_client_t *c, request_type type, uint32_t key, void *data, uint32_t data_length, uint64_t tag)
+{
+    uint32_t length = type == REQUEST_INSERT ? data_length : 0;
+    ring_record_t *r;
+    while ((r = ring_reserve(c->submit, length)) == NULL)
+    {
+        /*The server might wait for room for its completions*/
+        uint32_t head = atomic_load(&c->submit->head);
+        ring_submit(c);
+        ring_drain(c);
+        if ((r = ring_reserve(c->submit, length)) != NULL)
+            break;
+        ring_wait_space(c->submit, head);
+    }
+    r->type = type;
+    r->key = key;
+    r->length = data_length;
+    r->tag = tag;
+    if (length > 0)
+        memcpy(r->data, data, length);
+    if (++c->in_flight % RING_BURST == 0)
+        ring_submit(c);
+}
+
+/*Waits until all queued requests are completed*/
+void ring_flush(ring_client_t *c)
+{
+    ring_submit(c);
+    ring_drain(c);
+    while (c->in_flight > 0)
+    {
+        ring_wait_data(c->complete);
+        ring_drain(c);
+    }
+}
+
+/*Inserts, reads and deletes small values with batch requests,
+  every partition gets the keys it owns*/
+bool batch_test(int **arr, int **arr_cmp, uint32_t test_size, int ID, uint32_t lease)
+{
+    bool found_mismatch = false;
+    void **values = malloc(sizeof(void *) * test_size);
+    void **values_cmp = malloc(sizeof(void *) * test_size);
+    uint32_t *keys = malloc(sizeof(uint32_t) * test_size);
+    uint32_t *lengths = malloc(sizeof(uint32_t) * test_size);
+    uint32_t deleted = 0;
+    for (uint32_t p = 0; p < memory->partitions; p++)
+    {
+        uint32_t count = 0;
+        for (int i = 0; i < test_size; i++)
+        {
+            uint32_t key = BATCH_KEY_BASE + test_size * ID + i;
+            if (key_partition(memory, key) != p)
+                continue;
+            /*The first values of every row are used as small values*/
+            values[count] = arr[i];
+            values_cmp[count] = arr_cmp[i];
+            keys[count] = key;
+            lengths[count] = BATCH_VALUE_LENGTH < test_size * 4 ? BATCH_VALUE_LENGTH : test_size * 4;
+            memset(values_cmp[count], 0, lengths[count]);
+            count++;
+        }
+        exchange_t *e = get_slot(memory, p * memory->slot_count + lease);
+        lock_robust(&e->rw);
+        multi_insert(values, keys, lengths, count, &e->cond, &e->cond_mutex, e);
+        pthread_mutex_unlock(&e->rw);
+        lock_robust(&e->rw);
+        if (!multi_read(values_cmp, keys, lengths, count, &e->cond, &e->cond_mutex, e))
+            found_mismatch = true;
+        pthread_mutex_unlock(&e->rw);
+        for (int i = 0; i < count; i++)
+        {
+            if (memcmp(values[i], values_cmp[i], lengths[i]) != 0)
+            {
+                found_mismatch = true;
+                fprintf(stderr, "Client %d: Batch values do not match\n", ID);
+            }
+        }
+        lock_robust(&e->rw);
+        deleted += multi_delete(keys, count, &e->cond, &e->cond_mutex, e);
+        pthread_mutex_unlock(&e->rw);
+    }
+    if (deleted != test_size)
+    {
+        found_mismatch = true;
+        fprintf(stderr, "Client %d: Batch delete did not find all keys\n", ID);
+    }
+    free(values);
+    free(values_cmp);
+    free(keys);
+    free(lengths);
+    return found_mismatch;
+}
+
+/*Takes over the slot of a client that died, returns false if the owner is still alive*/
+static bool reclaim_slot(exchange_t *e, pid_t owner)
+{
+    if (owner == 0 || kill(owner, 0) == 0 || errno != ESRCH)
+        return false;
+    return atomic_compare_exchange_strong(&e->owner, &owner, getpid());
+}
+
+/*
+Leases a free slot and waits while all slots are leased.
+Slots of clients that died are freed by the server with the slot transport,
+with the ring transport they are taken over here and *reclaimed is set.
+*/
+static uint32_t lease_slot(m_t *memory, uint32_t ID, bool *reclaimed)
+{
+    *reclaimed = false;
+    bool waiting = false;
+    while (true)
+    {
+        for (uint32_t i = 0; i < memory->slot_count; i++)
+        {
+            uint32_t id = (ID + i) % memory->slot_count;
+            pid_t free_owner = 0;
+            if (atomic_compare_exchange_strong(&get_slot(memory, id)->owner, &free_owner, getpid()))
+                return id;
+        }
+        for (uint32_t i = 0; i < memory->slot_count && memory->transport == TRANSPORT_RING; i++)
+        {
+            uint32_t id = (ID + i) % memory->slot_count;
+            if (reclaim_slot(get_slot(memory, id), atomic_load(&get_slot(memory, id)->owner)))
+            {
+                *reclaimed = true;
+                return id;
+            }
+        }
+        if (!waiting)
+            fprintf(stderr, "Client %d: All %u slots are leased, waiting\n", ID, memory->slot_count);
+        waiting = true;
+        usleep(1000);
+    }
+}
+
+/*Drops the requests and completions a client that died left in the rings*/
+static void reset_rings(ring_pair_t *rings)
+{
+    ring_t *sq = &rings->submit;
+    ring_t *cq = &rings->complete;
+    /*Reserved but unpublished records are dropped*/
+    sq->reserved = atomic_load(&sq->tail);
+    /*The server publishes the completions before it releases the requests,
+      it may wait for space in the completion ring, so that is drained meanwhile*/
+    while (true)
+    {
+        bool done = atomic_load(&sq->head) == atomic_load(&sq->tail) || atomic_load(&sq->closed);
+        while (ring_peek(cq) != NULL)
+            ring_consume(cq);
+        ring_release(cq);
+        if (done)
+            break;
+        sched_yield();
+    }
+}
+
 /*
 Client is used to the test the server and the client functionality
 */
@@ -80,7 +497,6 @@ int main(int argc, char **argv)
     else
     {
         test_size = strtoul(argv[1], NULL, 10);
-        test_size = test_size > MAX_TRANSMISSION_SIZE ? MAX_TRANSMISSION_SIZE : test_size;
     }
 
     int **arr = malloc(sizeof(int *) * test_size);
@@ -100,7 +516,6 @@ int main(int argc, char **argv)
         }
     }
 
-    int size = (sizeof(exchange_t)) * CLIENT_SLOTS;
     int s = shm_open("shared-mem", O_RDWR, 0777);
     if (s < 0)
     {
@@ -108,35 +523,107 @@ int main(int argc, char **argv)
         return -1;
     }
 
-    m_t *memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, s, 0);
+    /*The header tells the size of the whole region*/
+    memory = mmap(NULL, sizeof(m_t), PROT_READ | PROT_WRITE, MAP_SHARED, s, 0);
+    if (memory == MAP_FAILED || memory->magic != SHM_MAGIC || memory->version != SHM_VERSION || memory->ring_size != RING_SIZE)
+    {
+        fprintf(stderr, "Shared memory has an unknown layout\n");
+        return -1;
+    }
+    size_t size = memory->total_size;
+    munmap(memory, sizeof(m_t));
+    memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, s, 0);
+    if (memory == MAP_FAILED)
+    {
+        fprintf(stderr, "Failed to map memory: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (memory->spin > 0)
+        ring_set_spin(memory->spin);
 
-    pthread_mutex_lock(&memory->id_lock);
+    lock_robust(&memory->id_lock);
     int ID = memory->client_count++;
-    int id = ID % CLIENT_SLOTS;
-    fprintf(stdout, "Client ID: %d, Test size: %d\n", id, test_size);
     pthread_mutex_unlock(&memory->id_lock);
+    bool reclaimed;
+    int id = lease_slot(memory, ID, &reclaimed);
+    fprintf(stdout, "Client ID: %d, Test size: %d\n", id, test_size);
 
-    pthread_mutex_t *cond_mutex = &memory->c_slots[id].cond_mutex;
-    pthread_cond_t *cond = &memory->c_slots[id].cond;
-    exchange_t *e = &memory->c_slots[id];
-    int i = 0;
+    /*Every key goes to the control block of the lease in the partition of the key*/
+    exchange_t *e;
+    uint32_t partitions = memory->partitions;
+
+    /*The rings of a slot have a single producer, rw is held for the whole session*/
+    bool use_ring = memory->transport == TRANSPORT_RING;
+    if (use_ring && test_size * 4 > RING_SIZE / 4)
+    {
+        fprintf(stderr, "Client %d: Values of %u bytes are too large for the ring transport\n", ID, test_size * 4);
+        return -1;
+    }
+    if (memory->shared_table)
+    {
+        tables = calloc(partitions, sizeof(shared_table_header_t *));
+        for (uint32_t p = 0; p < partitions; p++)
+        {
+            tables[p] = shared_table_map(p);
+            if (tables[p] == NULL)
+            {
+                fprintf(stderr, "Client %d: Failed to map the table of partition %u\n", ID, p);
+                return -1;
+            }
+        }
+    }
+    ring_client_t *rc = calloc(partitions, sizeof(ring_client_t));
+    for (uint32_t p = 0; p < partitions && use_ring; p++)
+    {
+        uint32_t slot = p * memory->slot_count + id;
+        rc[p] = (ring_client_t){.slot = slot, .submit = &get_rings(memory, slot)->submit, .complete = &get_rings(memory, slot)->complete,
+                                .targets = (void **)arr_cmp, .expected_length = test_size * 4};
+        lock_robust(&get_slot(memory, slot)->rw);
+        if (reclaimed)
+            reset_rings(get_rings(memory, slot));
+    }
 
     printf("Client %d: Insert Test\n", ID);
     for (int i = 0; i < test_size; i++)
     {
-        pthread_mutex_lock(&e->rw);
-        insert(arr[i], test_size * ID + i, test_size * 4, cond, cond_mutex, e);
+        uint32_t key = test_size * ID + i;
+        if (use_ring)
+        {
+            ring_request(&rc[key_partition(memory, key)], REQUEST_INSERT, key, arr[i], test_size * 4, i);
+            continue;
+        }
+        e = route_slot(memory, id, key);
+        lock_robust(&e->rw);
+        insert(arr[i], key, test_size * 4, &e->cond, &e->cond_mutex, e);
         pthread_mutex_unlock(&e->rw);
     }
 
     printf("Client %d: Read Test\n", ID);
+    /*Direct reads only see the inserts the server has already served*/
+    for (uint32_t p = 0; p < partitions && use_ring && tables != NULL; p++)
+        ring_flush(&rc[p]);
     for (int i = test_size - 1; i > -1; i--)
     {
-        pthread_mutex_lock(&e->rw);
-        mem_read(arr_cmp[i], test_size * ID + i, test_size * 4, cond, cond_mutex, e);
+        uint32_t key = test_size * ID + i;
+        if (tables != NULL && direct_read(arr_cmp[i], key, test_size * 4))
+            continue;
+        if (use_ring)
+        {
+            ring_request(&rc[key_partition(memory, key)], REQUEST_READ, key, NULL, test_size * 4, i);
+            continue;
+        }
+        e = route_slot(memory, id, key);
+        lock_robust(&e->rw);
+        mem_read(arr_cmp[i], key, test_size * 4, &e->cond, &e->cond_mutex, e);
         pthread_mutex_unlock(&e->rw);
     }
     bool found_mismatch = false;
+    for (uint32_t p = 0; p < partitions && use_ring; p++)
+    {
+        ring_flush(&rc[p]);
+        found_mismatch |= rc[p].mismatch;
+    }
     for (int i = 0; i < test_size; i++)
     {
         for (int j = 0; j < test_size; j++)
@@ -152,11 +639,37 @@ int main(int argc, char **argv)
 
     for (int i = 0; i < test_size; i++)
     {
-        pthread_mutex_lock(&e->rw);
-        delete (test_size * ID + i, cond, cond_mutex, e);
+        uint32_t key = test_size * ID + i;
+        if (use_ring)
+        {
+            ring_request(&rc[key_partition(memory, key)], REQUEST_DELETE, key, NULL, 0, i);
+            continue;
+        }
+        e = route_slot(memory, id, key);
+        lock_robust(&e->rw);
+        delete (key, &e->cond, &e->cond_mutex, e);
         pthread_mutex_unlock(&e->rw);
     }
 
+    if (use_ring)
+    {
+        for (uint32_t p = 0; p < partitions; p++)
+        {
+            ring_flush(&rc[p]);
+            found_mismatch |= rc[p].mismatch;
+            pthread_mutex_unlock(&get_slot(memory, rc[p].slot)->rw);
+        }
+    }
+    else
+    {
+        printf("Client %d: Batch Test\n", ID);
+        found_mismatch |= batch_test(arr, arr_cmp, test_size, ID, id);
+    }
+    free(rc);
+    for (uint32_t p = 0; p < partitions && tables != NULL; p++)
+        shared_table_unmap(tables[p]);
+    free(tables);
+
     for (int i = 0; i < test_size; i++)
     {
         free(arr[i]);
@@ -165,6 +678,15 @@ int main(int argc, char **argv)
     free(arr);
     free(arr_cmp);
 
+    for (uint32_t p = 0; p < partitions; p++)
+    {
+        e = get_slot(memory, p * memory->slot_count + id);
+        if (e->capacity > 0)
+            arena_free(get_arena(memory), e->payload, SLOT_BYTES(e) / ARENA_PAGE);
+        e->capacity = 0;
+    }
+    atomic_store(&get_slot(memory, id)->owner, 0);
+
     if (!found_mismatch)
         fprintf(stderr, "Client %d finished succesfully\n", ID);
     else
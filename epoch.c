@@ -0,0 +1,146 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "epoch.h"
+#ifdef USECUSTOMMALLOC
+#include "alloc.h"
+#endif
+
+/*Every thread tries to advance the epoch after this many retires*/
+#define RECLAIM_BATCH 64
+#define MIN_RETIRED 64
+
+typedef struct retired
+{
+    uint64_t epoch;
+    reclaim_function f;
+    void *ctx;
+    void *ptr;
+} retired_t;
+
+/*Each thread only writes to its own record, so entering an epoch
+  does not touch a cache line used by other threads*/
+typedef struct epoch_thread
+{
+    /*Epoch of the thread shifted by one, the lowest bit is set while it is inside*/
+    _Atomic uint64_t state;
+    struct epoch_thread *next;
+    /*Retired memory in order of the epoch, the first head entries are released*/
+    retired_t *retired;
+    uint32_t head;
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t since_reclaim;
+} __attribute__((aligned(64))) epoch_thread_t;
+
+static _Atomic uint64_t global_epoch = 1;
+/*Records are never removed, threads only get added*/
+static _Atomic(epoch_thread_t *) threads;
+static __thread epoch_thread_t *self;
+/*Number of epoch_enter calls of the thread without their epoch_exit*/
+static __thread uint32_t depth;
+
+static epoch_thread_t *register_thread()
+{
+    epoch_thread_t *e = aligned_alloc(64, sizeof(epoch_thread_t));
+    memset(e, 0, sizeof(epoch_thread_t));
+    e->next = atomic_load(&threads);
+    while (!atomic_compare_exchange_weak(&threads, &e->next, e))
+        ;
+    self = e;
+    return e;
+}
+
+void epoch_enter()
+{
+    if (depth++ > 0)
+        return;
+    epoch_thread_t *e = self != NULL ? self : register_thread();
+    atomic_store_explicit(&e->state, atomic_load(&global_epoch) << 1 | 1, memory_order_relaxed);
+    /*The state has to be visible before any shared pointer is loaded*/
+    atomic_thread_fence(memory_order_seq_cst);
+}
+
+void epoch_exit()
+{
+    if (--depth > 0)
+        return;
+    atomic_store_explicit(&self->state, 0, memory_order_release);
+}
+
+/*The epoch can only advance once all threads inside an epoch are in the current one*/
+static void try_advance()
+{
+    uint64_t epoch = atomic_load(&global_epoch);
+    for (epoch_thread_t *e = atomic_load(&threads); e != NULL; e = e->next)
+    {
+        uint64_t state = atomic_load(&e->state);
+        if ((state & 1) && (state >> 1) != epoch)
+            return;
+    }
+    atomic_compare_exchange_strong(&global_epoch, &epoch, epoch + 1);
+}
+
+/*Memory retired in epoch n can be released in epoch n + 2,
+  threads in epoch n + 1 entered after it was unlinked*/
+static void reclaim(epoch_thread_t *e)
+{
+    uint64_t epoch = atomic_load(&global_epoch);
+    while (e->head < e->count && e->retired[e->head].epoch + 2 <= epoch)
+    {
+        retired_t *r = &e->retired[e->head++];
+        r->f(r->ctx, r->ptr);
+    }
+    if (e->head == e->count)
+    {
+        e->head = 0;
+        e->count = 0;
+    }
+}
+
+void epoch_retire(void *ptr, reclaim_function f, void *ctx)
+{
+    epoch_thread_t *e = self != NULL ? self : register_thread();
+    if (e->count == e->capacity)
+    {
+        if (e->head > 0)
+        {
+            memmove(e->retired, e->retired + e->head, (e->count - e->head) * sizeof(retired_t));
+            e->count -= e->head;
+            e->head = 0;
+        }
+        else
+        {
+            uint32_t capacity = e->capacity ? e->capacity * 2 : MIN_RETIRED;
+            retired_t *retired = realloc(e->retired, capacity * sizeof(retired_t));
+            if (retired == NULL)
+            {
+                fprintf(stderr, "Retire list is full, leaking %p\n", ptr);
+                return;
+            }
+            e->retired = retired;
+            e->capacity = capacity;
+        }
+    }
+    e->retired[e->count++] = (retired_t){.epoch = atomic_load(&global_epoch), .f = f, .ctx = ctx, .ptr = ptr};
+    if (++e->since_reclaim >= RECLAIM_BATCH)
+    {
+        e->since_reclaim = 0;
+        try_advance();
+        reclaim(e);
+    }
+}
+
+void epoch_drain()
+{
+    for (epoch_thread_t *e = atomic_load(&threads); e != NULL; e = e->next)
+    {
+        for (uint32_t i = e->head; i < e->count; i++)
+            e->retired[i].f(e->retired[i].ctx, e->retired[i].ptr);
+        e->head = 0;
+        e->count = 0;
+    }
+}
@@ -0,0 +1,21 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+/*
+Epoch based reclamation.
+Readers that access shared memory without a lock do so between epoch_enter and epoch_exit.
+Memory they might still see is retired instead of freed and only released
+once every thread inside an epoch has entered it after the memory was retired.
+Calls may be nested, a thread leaves its epoch with the outermost epoch_exit.
+*/
+
+typedef void (*reclaim_function)(void *ctx, void *ptr);
+
+void epoch_enter();
+void epoch_exit();
+/*Calls f(ctx, ptr) once no reader can access ptr anymore*/
+void epoch_retire(void *ptr, reclaim_function f, void *ctx);
+/*Releases everything retired so far, no thread may be inside an epoch*/
+void epoch_drain();
+
+#endif
@@ -2,33 +2,214 @@
 #define EXCHANGE_H
 
 #include <stdint.h>
+#include <stdatomic.h>
+#include <errno.h>
 #include <pthread.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include "ring.h"
+#include "arena.h"
 
+/*Defaults, the server can be started with other sizes*/
 #define CLIENT_SLOTS 20
 #define MAX_TRANSMISSION_SIZE 4096
 
+/*The layout of the shared memory changes with the version*/
+#define SHM_MAGIC 0x6b76736d
+#define SHM_VERSION 6
+
 typedef enum {
     NO_REQUEST = 0,
     REQUEST_INSERT,
     REQUEST_READ,
     REQUEST_DELETE,
+    REQUEST_MULTI_INSERT,
+    REQUEST_MULTI_READ,
+    REQUEST_MULTI_DELETE,
+    REQUEST_STREAM_INSERT,
+    REQUEST_STREAM_READ,
 }request_type;
 
+/*
+Batch requests carry many keys in one round trip, key holds the number of operations.
+REQUEST_MULTI_INSERT: data holds for every value its key, its length in bytes
+                      and the value padded to whole words.
+REQUEST_MULTI_READ:   data holds the keys. The server replaces them by the length of
+                      every value (BATCH_MISSING if not found) followed by the padded value.
+                      key is set to the number of values that fit, the rest has to be requested again.
+REQUEST_MULTI_DELETE: data holds the keys, length is set to the number of deleted keys.
+*/
+#define BATCH_WORDS(length) (((length) + 3) / 4)
+#define BATCH_MISSING UINT32_MAX
+
+/*
+Values larger than data are streamed in chunks, offset is the position of the chunk in the value.
+REQUEST_STREAM_INSERT: total is the length of the whole value, length the length of the chunk.
+                       Chunks have to be sent in order, the value is inserted with the last one.
+                       length is set to 0 if the chunk was rejected.
+REQUEST_STREAM_READ:   The server copies the value from offset on into data and sets length
+                       to the length of the chunk and total to the length of the value
+                       (BATCH_MISSING if not found).
+*/
+
+/*
+Control block of a slot. The data of a request lies in the payload arena,
+payload is the first page of the run the client took and capacity its length in words.
+The blocks are padded to whole cache lines, so slots do not share a line.
+*/
 typedef struct exchange{
     pthread_mutex_t rw;
     pthread_mutex_t cond_mutex;
     pthread_cond_t  cond;
-    request_type type;
-    
+    /*Atomic, so a side polling the slot sees the request without the mutex*/
+    _Atomic request_type type;
+    /*Process id of the client that leased the slot, 0 if it is free*/
+    _Atomic pid_t owner;
+    uint32_t payload;
+    /*Number of words in the payload, 0 if the client took no pages*/
+    uint32_t capacity;
+
     uint32_t key;
     uint32_t length;
-    uint32_t data[MAX_TRANSMISSION_SIZE];
-}exchange_t;
+    uint32_t offset;
+    uint32_t total;
+}__attribute__((aligned(64))) exchange_t;
+
+#define SLOT_BYTES(e) ((e)->capacity * sizeof(uint32_t))
 
+/*
+With TRANSPORT_RING every slot is used through a pair of rings instead of its exchange_t.
+Requests are ring records with the request type, key, value length and the value as data.
+A read request passes the size of the client buffer as length.
+The completion has the same type, key and tag, length is the length of the value
+(BATCH_MISSING if not found) for reads and 1 if the key was found for deletes.
+An insert whose value does not fit into its record is dropped, its completion has length BATCH_MISSING.
+Completions are returned in the order of the requests.
+*/
+typedef enum {
+    TRANSPORT_SLOT = 0,
+    TRANSPORT_RING,
+}transport_type;
+
+typedef struct ring_pair{
+    ring_t submit;
+    ring_t complete;
+} ring_pair_t;
+
+/*Rung by the clients after every request for the pool of a partition, its workers sleep on it*/
+typedef struct doorbell{
+    _Atomic uint32_t ring;
+    _Atomic uint32_t sleepers;
+}__attribute__((aligned(64))) doorbell_t;
+
+/*
+Header at the start of the shared memory. The control blocks, the payload arena
+and the rings follow it, their number and size are only known at runtime.
+*/
 typedef struct memory_exchange{
+    uint32_t magic;
+    uint32_t version;
+    /*Number of leases, every lease has a control block in every partition*/
+    uint32_t slot_count;
+    /*Keys are split into partitions with their own table, 1 if the server is not sharded*/
+    uint32_t partitions;
+    /*Bytes from one control block to the next*/
+    uint32_t slot_size;
+    uint32_t ring_size;
+    transport_type transport;
+    /*Largest payload of one request in words*/
+    uint32_t max_words;
+    uint64_t slots_offset;
+    uint64_t arena_offset;
+    uint64_t pages_offset;
+    /*0 without TRANSPORT_RING*/
+    uint64_t rings_offset;
+    uint64_t doorbells_offset;
+    uint64_t total_size;
     pthread_mutex_t id_lock;
     uint32_t client_count;
-    exchange_t c_slots[CLIENT_SLOTS];
+    /*Number of workers per partition if the server runs worker pools, 0 for a thread per slot*/
+    uint32_t workers;
+    /*Checks of the slot before a waiting side sleeps, 0 if the server does not busy poll*/
+    uint32_t spin;
+    /*Set if the tables are in segments of their own the clients read from, see sharedtable.h*/
+    uint32_t shared_table;
 } m_t;
 
+/*Control blocks and rings are numbered partition * slot_count + lease*/
+static inline exchange_t *get_slot(m_t *m, uint32_t i)
+{
+    return (exchange_t *)((char *)m + m->slots_offset + (uint64_t)i * m->slot_size);
+}
+
+static inline uint32_t slot_index(m_t *m, exchange_t *e)
+{
+    return ((char *)e - ((char *)m + m->slots_offset)) / m->slot_size;
+}
+
+/*Partition of a key, the hash differs from the ones of the tables*/
+static inline uint32_t partition_of(uint32_t partitions, uint32_t key)
+{
+    return ((uint64_t)(key * 2654435761u) * partitions) >> 32;
+}
+
+static inline uint32_t key_partition(m_t *m, uint32_t key)
+{
+    return partition_of(m->partitions, key);
+}
+
+/*Control block of a lease in the partition of key*/
+static inline exchange_t *route_slot(m_t *m, uint32_t lease, uint32_t key)
+{
+    return get_slot(m, key_partition(m, key) * m->slot_count + lease);
+}
+
+static inline doorbell_t *get_doorbell(m_t *m, uint32_t partition)
+{
+    return (doorbell_t *)((char *)m + m->doorbells_offset) + partition;
+}
+
+static inline arena_t *get_arena(m_t *m)
+{
+    return (arena_t *)((char *)m + m->arena_offset);
+}
+
+static inline uint32_t *get_payload(m_t *m, exchange_t *e)
+{
+    return (uint32_t *)((char *)m + m->pages_offset + (uint64_t)e->payload * ARENA_PAGE);
+}
+
+/*Checks that the payload of a slot lies inside the arena*/
+static inline int payload_valid(m_t *m, exchange_t *e)
+{
+    return (uint64_t)e->payload * ARENA_PAGE + SLOT_BYTES(e) <= (uint64_t)get_arena(m)->page_count * ARENA_PAGE;
+}
+
+static inline ring_pair_t *get_rings(m_t *m, uint32_t i)
+{
+    return (ring_pair_t *)((char *)m + m->rings_offset) + i;
+}
+
+/*Wakes a sleeping worker of the pool serving slot i, has to be called after the request is visible*/
+static inline void notify_workers(m_t *m, uint32_t i)
+{
+    if (m->workers == 0)
+        return;
+    doorbell_t *d = get_doorbell(m, i / m->slot_count);
+    atomic_fetch_add(&d->ring, 1);
+    if (atomic_load(&d->sleepers) > 0)
+        syscall(SYS_futex, &d->ring, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+/*The mutexes are robust, a mutex held by a client that died is taken over*/
+static inline int lock_robust(pthread_mutex_t *m)
+{
+    int r = pthread_mutex_lock(m);
+    if (r == EOWNERDEAD)
+        r = pthread_mutex_consistent(m);
+    return r;
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,695 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "table.h"
+#include "epoch.h"
+#ifdef USECUSTOMMALLOC
+#include "alloc.h"
+#endif
+
+/*Values up to INLINE_VALUE_SIZE bytes are stored in the entry itself,
+  larger ones in a separate allocation*/
+typedef struct hash_table_entry
+{
+    uint32_t key;
+    /*Length of the value, ENTRY_USED is set for every entry holding a value*/
+    uint32_t length;
+    struct hash_table_entry *next;
+    union
+    {
+        void *obj;
+        uint8_t data[INLINE_VALUE_SIZE];
+    };
+} entry_t;
+
+#define ENTRY_USED 0x80000000u
+
+static inline bool entry_used(const entry_t *e)
+{
+    return e->length & ENTRY_USED;
+}
+
+static inline uint32_t entry_length(const entry_t *e)
+{
+    return e->length & ~ENTRY_USED;
+}
+
+/*Readers do not lock a bucket. Writers make seq odd while they change
+  the bucket, a reader retries if seq was odd or changed during its lookup.
+  Chain entries, values and bucket arrays are freed through epoch.h,
+  so a reader never follows a pointer into freed memory*/
+typedef struct hash_table_entry_data
+{
+    entry_t entry;
+    pthread_mutex_t lock;
+    _Atomic uint32_t seq;
+    /*Set once all entries were moved to the next bucket array*/
+    bool migrated;
+} entry_data_t;
+
+/*Chain nodes are taken from pages of POOL_PAGE_ENTRIES entries.
+  Buckets are split into POOL_SHARDS shards with their own pages and free list,
+  so nodes of one chain are close together*/
+#define POOL_SHARDS 64
+#define POOL_PAGE_ENTRIES 128
+
+/*The table doubles once there are GROW_LOAD entries per bucket and
+  halves again below 1/SHRINK_LOAD_DEN entries per bucket, but never below
+  its initial size. Every operation during a resize moves MIGRATE_BUCKETS
+  buckets to the new array, so no single request pays for the whole resize*/
+#define GROW_LOAD 2
+#define SHRINK_LOAD_DEN 8
+#define MIGRATE_BUCKETS 4
+
+typedef struct entry_page
+{
+    struct entry_page *next;
+    entry_t entries[POOL_PAGE_ENTRIES];
+} entry_page_t;
+
+typedef struct entry_pool
+{
+    pthread_spinlock_t lock;
+    entry_t *free_list;
+    entry_page_t *pages;
+    /*Entries with key % POOL_SHARDS == shard, used to estimate the load*/
+    _Atomic int64_t entries;
+} __attribute__((aligned(64))) entry_pool_t;
+
+typedef struct bucket_array
+{
+    uint32_t size;
+    /*Migration of this array into migrate_to during a resize*/
+    struct bucket_array *migrate_to;
+    _Atomic uint32_t migrate_next;
+    _Atomic uint32_t migrated;
+    entry_data_t table[];
+} bucket_array_t;
+
+typedef struct hashtable
+{
+    _Atomic(bucket_array_t *) buckets;
+    /*Array that is migrated into buckets or NULL*/
+    _Atomic(bucket_array_t *) old_buckets;
+    pthread_mutex_t resize_lock;
+    uint32_t min_size;
+    uint32_t resizes;
+    entry_pool_t pools[POOL_SHARDS];
+} hashtable_t;
+
+/*Zeroed memory is an initialized mutex on glibc, which makes allocating
+  a large bucket array during a resize cheap*/
+static bool zero_is_mutex_init()
+{
+    static const pthread_mutex_t initializer = PTHREAD_MUTEX_INITIALIZER;
+    static const pthread_mutex_t zero;
+    return memcmp(&initializer, &zero, sizeof(pthread_mutex_t)) == 0;
+}
+
+static bucket_array_t *create_buckets(uint32_t size)
+{
+    bucket_array_t *b = calloc(1, sizeof(bucket_array_t) + sizeof(entry_data_t) * size);
+    if (b == NULL)
+        return NULL;
+    b->size = size;
+    if (!zero_is_mutex_init())
+    {
+        for (uint32_t i = 0; i < size; i++)
+            pthread_mutex_init(&b->table[i].lock, NULL);
+    }
+    return b;
+}
+
+static void destroy_buckets(void *ctx, void *ptr)
+{
+    bucket_array_t *b = ptr;
+    if (!zero_is_mutex_init())
+    {
+        for (uint32_t i = 0; i < b->size; i++)
+            pthread_mutex_destroy(&b->table[i].lock);
+    }
+    free(b);
+}
+
+void *create_hashtable(uint32_t size)
+{
+    if (size == 0)
+        size = 1;
+    hashtable_t *t = aligned_alloc(64, sizeof(hashtable_t));
+    memset(t, 0, sizeof(hashtable_t));
+    t->buckets = create_buckets(size);
+    t->min_size = size;
+    pthread_mutex_init(&t->resize_lock, NULL);
+    for (int i = 0; i < POOL_SHARDS; i++)
+    {
+        pthread_spin_init(&t->pools[i].lock, PTHREAD_PROCESS_PRIVATE);
+    }
+    return t;
+}
+entry_t *pool_alloc(hashtable_t *t, uint32_t position)
+{
+    entry_pool_t *p = &t->pools[position % POOL_SHARDS];
+    pthread_spin_lock(&p->lock);
+    if (p->free_list == NULL)
+    {
+        entry_page_t *page = malloc(sizeof(entry_page_t));
+        if (page == NULL)
+        {
+            pthread_spin_unlock(&p->lock);
+            return NULL;
+        }
+        page->next = p->pages;
+        p->pages = page;
+        for (int i = 0; i < POOL_PAGE_ENTRIES; i++)
+        {
+            page->entries[i].next = p->free_list;
+            p->free_list = &page->entries[i];
+        }
+    }
+    entry_t *e = p->free_list;
+    p->free_list = e->next;
+    pthread_spin_unlock(&p->lock);
+    return e;
+}
+
+void pool_free(hashtable_t *t, uint32_t position, entry_t *e)
+{
+    entry_pool_t *p = &t->pools[position % POOL_SHARDS];
+    pthread_spin_lock(&p->lock);
+    e->next = p->free_list;
+    p->free_list = e;
+    pthread_spin_unlock(&p->lock);
+}
+
+static void free_node(void *ctx, void *ptr)
+{
+    entry_t *e = ptr;
+    pool_free(ctx, e->key, e);
+}
+
+static void free_value(void *ctx, void *ptr)
+{
+    free(ptr);
+}
+
+static void lock_bucket(entry_data_t *b)
+{
+    pthread_mutex_lock(&b->lock);
+    atomic_store_explicit(&b->seq, atomic_load_explicit(&b->seq, memory_order_relaxed) + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+static void unlock_bucket(entry_data_t *b)
+{
+    atomic_store_explicit(&b->seq, atomic_load_explicit(&b->seq, memory_order_relaxed) + 1, memory_order_release);
+    pthread_mutex_unlock(&b->lock);
+}
+
+void destroy_pools(hashtable_t *t)
+{
+    for (int i = 0; i < POOL_SHARDS; i++)
+    {
+        entry_page_t *next;
+        for (entry_page_t *page = t->pools[i].pages; page != NULL; page = next)
+        {
+            next = page->next;
+            free(page);
+        }
+        pthread_spin_destroy(&t->pools[i].lock);
+    }
+}
+
+/*Moves the data of src to the end of the chain in array to.
+  If src is a chain node it is reused, otherwise a new node is taken*/
+static void move_entry(hashtable_t *t, bucket_array_t *to, entry_t *src, entry_t *node)
+{
+    uint32_t position = src->key % to->size;
+    entry_data_t *d = &to->table[position];
+    lock_bucket(d);
+    entry_t value = *src;
+    value.next = NULL;
+    if (!entry_used(&d->entry))
+    {
+        d->entry = value;
+        if (node != NULL)
+            epoch_retire(node, free_node, t);
+    }
+    else
+    {
+        entry_t *current = &d->entry;
+        for (; current->next != NULL; current = current->next);
+        if (node == NULL)
+            node = pool_alloc(t, position);
+        if (node == NULL)
+        {
+            /*Readers of the old bucket may still copy the value*/
+            fprintf(stderr, "Could not allocate entry, dropping key %u\n", value.key);
+            if (!is_inline(entry_length(&value)))
+                epoch_retire(value.obj, free_value, NULL);
+            atomic_fetch_sub_explicit(&t->pools[value.key % POOL_SHARDS].entries, 1, memory_order_relaxed);
+        }
+        else
+        {
+            *node = value;
+            current->next = node;
+        }
+    }
+    unlock_bucket(d);
+}
+
+static void migrate_bucket(hashtable_t *t, entry_data_t *b, bucket_array_t *to)
+{
+    lock_bucket(b);
+    if (entry_used(&b->entry))
+    {
+        entry_t *next = b->entry.next;
+        move_entry(t, to, &b->entry, NULL);
+        while (next != NULL)
+        {
+            entry_t *n = next;
+            next = n->next;
+            move_entry(t, to, n, n);
+        }
+    }
+    b->entry = (entry_t){.length = 0};
+    b->migrated = true;
+    unlock_bucket(b);
+}
+
+/*Moves the next few buckets of a running resize*/
+static void migrate_step(hashtable_t *t)
+{
+    bucket_array_t *old = atomic_load(&t->old_buckets);
+    if (old == NULL)
+        return;
+    for (int i = 0; i < MIGRATE_BUCKETS; i++)
+    {
+        uint32_t n = atomic_fetch_add(&old->migrate_next, 1);
+        if (n >= old->size)
+            return;
+        migrate_bucket(t, &old->table[n], old->migrate_to);
+        if (atomic_fetch_add(&old->migrated, 1) + 1 == old->size)
+        {
+            /*Last bucket moved, the resize is done*/
+            pthread_mutex_lock(&t->resize_lock);
+            atomic_store(&t->old_buckets, NULL);
+            pthread_mutex_unlock(&t->resize_lock);
+            epoch_retire(old, destroy_buckets, NULL);
+            return;
+        }
+    }
+}
+
+static int64_t count_entries(hashtable_t *t)
+{
+    int64_t count = 0;
+    for (int i = 0; i < POOL_SHARDS; i++)
+        count += atomic_load_explicit(&t->pools[i].entries, memory_order_relaxed);
+    return count;
+}
+
+/*Starts a resize if the load of the table is outside its limits.
+  The load is estimated from the shard of key first, so the
+  shards only have to be summed up if a resize is likely*/
+static void check_load(hashtable_t *t, uint32_t key)
+{
+    bucket_array_t *cur = atomic_load(&t->buckets);
+    int64_t estimate = atomic_load_explicit(&t->pools[key % POOL_SHARDS].entries, memory_order_relaxed) * POOL_SHARDS;
+    bool grow = estimate > (int64_t)cur->size * GROW_LOAD;
+    bool shrink = cur->size > t->min_size && estimate * SHRINK_LOAD_DEN < cur->size;
+#ifdef NO_TABLE_SHRINK
+    shrink = false;
+#endif
+    if (!grow && !shrink)
+        return;
+    if (atomic_load(&t->old_buckets) != NULL || pthread_mutex_trylock(&t->resize_lock) != 0)
+        return;
+
+    int64_t count = count_entries(t);
+    cur = atomic_load(&t->buckets);
+    uint32_t size = cur->size;
+    if (count > (int64_t)size * GROW_LOAD)
+        size *= 2;
+    else if (size > t->min_size && count * SHRINK_LOAD_DEN < size)
+        size /= 2;
+    bucket_array_t *next = NULL;
+    if (atomic_load(&t->old_buckets) == NULL && size != cur->size)
+        next = create_buckets(size < t->min_size ? t->min_size : size);
+    if (next != NULL)
+    {
+        cur->migrate_to = next;
+        atomic_store(&cur->migrate_next, 0);
+        atomic_store(&cur->migrated, 0);
+        /*Readers load buckets before old_buckets,
+          so they see the old array once they see the new one*/
+        atomic_store(&t->old_buckets, cur);
+        atomic_store(&t->buckets, next);
+        t->resizes++;
+    }
+    pthread_mutex_unlock(&t->resize_lock);
+}
+
+/*Returns the locked bucket responsible for key. During a resize this is
+  the bucket of the old array as long as it was not migrated yet*/
+static entry_data_t *find_bucket(hashtable_t *t, uint32_t key)
+{
+    for (;;)
+    {
+        bucket_array_t *cur = atomic_load(&t->buckets);
+        bucket_array_t *old = atomic_load(&t->old_buckets);
+        bucket_array_t *arrays[2] = {old, cur};
+        for (int i = 0; i < 2; i++)
+        {
+            if (arrays[i] == NULL)
+                continue;
+            entry_data_t *b = &arrays[i]->table[key % arrays[i]->size];
+            lock_bucket(b);
+            if (!b->migrated)
+                return b;
+            unlock_bucket(b);
+        }
+    }
+}
+
+static uint64_t clear_entries(entry_t *curr)
+{
+    uint64_t count = 0;
+    for (; curr != NULL; curr = curr->next)
+    {
+        if (!is_inline(entry_length(curr)))
+            free(curr->obj);
+        count++;
+    }
+    return count;
+}
+
+uint64_t clear_hashtable(void *table)
+{
+    hashtable_t *t = table;
+    uint64_t count = 0;
+    /*Retired chain entries go back to the pools, so this has to happen first*/
+    epoch_drain();
+    bucket_array_t *arrays[2] = {atomic_load(&t->old_buckets), atomic_load(&t->buckets)};
+    for (int a = 0; a < 2; a++)
+    {
+        if (arrays[a] == NULL)
+            continue;
+        for (uint32_t i = 0; i < arrays[a]->size; i++)
+        {
+            entry_data_t *b = &arrays[a]->table[i];
+            if (!b->migrated && entry_used(&b->entry))
+                count += clear_entries(&b->entry);
+        }
+        destroy_buckets(NULL, arrays[a]);
+    }
+    /*Chain nodes are released together with their pages*/
+    destroy_pools(t);
+    pthread_mutex_destroy(&t->resize_lock);
+    free(t);
+    return count;
+}
+
+static bool insert_entry(hashtable_t *t, entry_t value)
+{
+    uint32_t key = value.key;
+    epoch_enter();
+    migrate_step(t);
+    entry_data_t *b = find_bucket(t, key);
+    atomic_fetch_add_explicit(&t->pools[key % POOL_SHARDS].entries, 1, memory_order_relaxed);
+    if (!entry_used(&b->entry))
+    {
+        b->entry = value;
+        unlock_bucket(b);
+        check_load(t, key);
+        epoch_exit();
+        return true;
+    }
+
+    entry_t *current = &b->entry;
+    uint32_t length = 1;
+    for (; current->next != NULL; current = current->next)
+        length++;
+    entry_t *e = pool_alloc(t, key);
+    if (e == NULL)
+    {
+        atomic_fetch_sub_explicit(&t->pools[key % POOL_SHARDS].entries, 1, memory_order_relaxed);
+        unlock_bucket(b);
+        epoch_exit();
+        fprintf(stderr, "Could not allocate entry, dropping key %u\n", key);
+        if (!is_inline(entry_length(&value)))
+            free(value.obj);
+        return false;
+    }
+    *e = value;
+    /*Readers may follow next at any time, so the entry is filled first*/
+    __atomic_store_n(&current->next, e, __ATOMIC_RELEASE);
+
+    unlock_bucket(b);
+    if (length >= GROW_LOAD)
+        check_load(t, key);
+    epoch_exit();
+    return true;
+}
+
+bool insert(void *table, uint32_t key, const void *data, uint32_t data_length)
+{
+    entry_t value = {.key = key, .length = data_length | ENTRY_USED, .next = NULL};
+    if (is_inline(data_length))
+    {
+        memcpy(value.data, data, data_length);
+    }
+    else
+    {
+        value.obj = malloc(data_length);
+        if (value.obj == NULL)
+        {
+            fprintf(stderr, "Could not allocate value, dropping key %u\n", key);
+            return false;
+        }
+        memcpy(value.obj, data, data_length);
+    }
+    return insert_entry(table, value);
+}
+
+bool insert_owned(void *table, uint32_t key, void *data, uint32_t data_length)
+{
+    entry_t value = {.key = key, .length = data_length | ENTRY_USED, .next = NULL};
+    if (is_inline(data_length))
+    {
+        memcpy(value.data, data, data_length);
+        free(data);
+    }
+    else
+    {
+        value.obj = data;
+    }
+    return insert_entry(table, value);
+}
+
+/*Looks key up in bucket b without locking it. Inline values are copied to dest
+  right away, for others obj is set. Returns false if a writer changed
+  the bucket meanwhile and the lookup has to be repeated*/
+static bool read_bucket(entry_data_t *b, uint32_t key, uint32_t offset, void *dest, uint32_t capacity, int64_t *length, void **obj)
+{
+    uint32_t seq = atomic_load_explicit(&b->seq, memory_order_acquire);
+    if (seq & 1)
+        return false;
+    *length = -1;
+    *obj = NULL;
+    for (entry_t *current = &b->entry; current != NULL; current = __atomic_load_n(&current->next, __ATOMIC_ACQUIRE))
+    {
+        uint32_t l = __atomic_load_n(&current->length, __ATOMIC_RELAXED);
+        if (__atomic_load_n(&current->key, __ATOMIC_RELAXED) == key && (l & ENTRY_USED))
+        {
+            l &= ~ENTRY_USED;
+            *length = l;
+            /*A torn copy is detected by the check of seq below*/
+            if (is_inline(l))
+                copy_range(dest, current->data, l, offset, capacity);
+            else
+                *obj = __atomic_load_n(&current->obj, __ATOMIC_RELAXED);
+            break;
+        }
+    }
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&b->seq, memory_order_relaxed) == seq;
+}
+
+int64_t read_table(void *table, uint32_t key, uint32_t offset, void *dest, uint32_t capacity)
+{
+    hashtable_t *t = table;
+    int64_t length = -1;
+    void *obj = NULL;
+    epoch_enter();
+    migrate_step(t);
+    for (bool found = false; !found;)
+    {
+        bucket_array_t *cur = atomic_load(&t->buckets);
+        bucket_array_t *old = atomic_load(&t->old_buckets);
+        bucket_array_t *arrays[2] = {old, cur};
+        for (int i = 0; i < 2 && !found; i++)
+        {
+            if (arrays[i] == NULL)
+                continue;
+            entry_data_t *b = &arrays[i]->table[key % arrays[i]->size];
+            /*A migrated bucket never changes again*/
+            if (__atomic_load_n(&b->migrated, __ATOMIC_ACQUIRE))
+                continue;
+            while (!read_bucket(b, key, offset, dest, capacity, &length, &obj))
+                ;
+            /*The bucket might have been migrated while it was read*/
+            found = !__atomic_load_n(&b->migrated, __ATOMIC_ACQUIRE) || length >= 0;
+        }
+    }
+    /*Separate values are never changed and cannot be freed before epoch_exit*/
+    if (obj != NULL)
+        copy_range(dest, obj, length, offset, capacity);
+    epoch_exit();
+    return length;
+}
+
+/*Separate values may still be copied by a reader*/
+static void release_value(entry_t *e)
+{
+    if (!is_inline(entry_length(e)))
+        epoch_retire(e->obj, free_value, NULL);
+}
+
+/*Removes the first entry of key from the locked bucket*/
+static bool bucket_remove(hashtable_t *t, entry_data_t *b, uint32_t key)
+{
+    if (b->entry.key == key && entry_used(&b->entry))
+    {
+        release_value(&b->entry);
+        if (b->entry.next != NULL)
+        {
+            entry_t *next = b->entry.next;
+            b->entry = *next;
+            epoch_retire(next, free_node, t);
+        }
+        else
+        {
+            b->entry = (entry_t){.length = 0};
+        }
+        return true;
+    }
+
+    for (entry_t *current = &b->entry; current->next != NULL; current = current->next)
+    {
+        if (current->next->key == key)
+        {
+            entry_t *next = current->next;
+            release_value(next);
+            current->next = current->next->next;
+            epoch_retire(next, free_node, t);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool delete(void *table, uint32_t key)
+{
+    hashtable_t *t = table;
+    epoch_enter();
+    migrate_step(t);
+    entry_data_t *b = find_bucket(t, key);
+    bool r = bucket_remove(t, b, key);
+    unlock_bucket(b);
+    if (r)
+    {
+        atomic_fetch_sub_explicit(&t->pools[key % POOL_SHARDS].entries, 1, memory_order_relaxed);
+        check_load(t, key);
+    }
+    epoch_exit();
+    return r;
+}
+
+/*Visits the buckets of the old array before the new one, so a bucket
+  migrated meanwhile is visited in one of them*/
+void for_each_entry(void *table, table_visit_t visit, void *ctx)
+{
+    hashtable_t *t = table;
+    epoch_enter();
+    bucket_array_t *cur = atomic_load(&t->buckets);
+    bucket_array_t *old = atomic_load(&t->old_buckets);
+    bucket_array_t *arrays[2] = {old, cur};
+    for (int a = 0; a < 2; a++)
+    {
+        if (arrays[a] == NULL)
+            continue;
+        for (uint32_t i = 0; i < arrays[a]->size; i++)
+        {
+            entry_data_t *b = &arrays[a]->table[i];
+            pthread_mutex_lock(&b->lock);
+            if (!b->migrated && entry_used(&b->entry))
+            {
+                for (entry_t *current = &b->entry; current != NULL; current = current->next)
+                {
+                    uint32_t length = entry_length(current);
+                    visit(ctx, current->key, is_inline(length) ? current->data : current->obj, length);
+                }
+            }
+            pthread_mutex_unlock(&b->lock);
+        }
+    }
+    epoch_exit();
+}
+
+/*Prints the number of entries and the chain lengths of the table*/
+void print_table_stats(void *table, FILE *f)
+{
+    hashtable_t *t = table;
+    uint64_t entries = 0;
+    uint32_t used_buckets = 0;
+    uint32_t longest_chain = 0;
+    epoch_enter();
+    bucket_array_t *cur = atomic_load(&t->buckets);
+    bucket_array_t *old = atomic_load(&t->old_buckets);
+    bucket_array_t *arrays[2] = {old, cur};
+    for (int a = 0; a < 2; a++)
+    {
+        if (arrays[a] == NULL)
+            continue;
+        for (uint32_t i = 0; i < arrays[a]->size; i++)
+        {
+            entry_data_t *b = &arrays[a]->table[i];
+            pthread_mutex_lock(&b->lock);
+            uint32_t length = 0;
+            if (!b->migrated && entry_used(&b->entry))
+            {
+                for (entry_t *current = &b->entry; current != NULL; current = current->next)
+                    length++;
+            }
+            pthread_mutex_unlock(&b->lock);
+            entries += length;
+            used_buckets += length > 0;
+            longest_chain = length > longest_chain ? length : longest_chain;
+        }
+    }
+    fprintf(f, "Table size:           %u\n", cur->size);
+    if (old != NULL)
+        fprintf(f, "Resizing from:        %u (%u buckets moved)\n", old->size, atomic_load(&old->migrated));
+    epoch_exit();
+    fprintf(f, "Resizes:              %u\n", t->resizes);
+    fprintf(f, "Entries:              %lu\n", entries);
+    fprintf(f, "Used buckets:         %u\n", used_buckets);
+    fprintf(f, "Longest chain:        %u\n", longest_chain);
+    fprintf(f, "Avg. chain length:    %.3f\n", used_buckets ? (double)entries / used_buckets : 0.0);
+}
+
+const table_engine_t chain_engine = {
+    .name = "chain",
+    .create = create_hashtable,
+    .insert = insert,
+    .insert_owned = insert_owned,
+    .read = read_table,
+    .delete = delete,
+    .destroy = clear_hashtable,
+    .for_each = for_each_entry,
+    .print_stats = print_table_stats,
+};
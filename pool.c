@@ -0,0 +1,271 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sched.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include "pool.h"
+#include "ring.h"
+
+/*Seconds a worker sleeps before it checks the slots*/
+#define POOL_CHECK_INTERVAL 1
+
+/*Slots claimed by one worker, the owner takes from the bottom, thieves from the top*/
+typedef struct deque
+{
+    pthread_mutex_t lock;
+    uint32_t top;
+    uint32_t bottom;
+    uint32_t *slots;
+} __attribute__((aligned(64))) deque_t;
+
+typedef struct worker
+{
+    pool_t *pool;
+    uint32_t id;
+    pthread_t thread;
+} worker_t;
+
+struct pool
+{
+    const pool_ops_t *ops;
+    uint32_t worker_count;
+    uint32_t first_slot;
+    uint32_t slot_count;
+    uint32_t spin;
+    _Atomic uint32_t running;
+    _Atomic uint32_t *doorbell;
+    _Atomic uint32_t *sleepers;
+    /*Set while a slot is in a deque or served*/
+    _Atomic uint8_t *claimed;
+    deque_t *deques;
+    worker_t *workers;
+};
+
+static void futex_wait(_Atomic uint32_t *word, uint32_t value, struct timespec *timeout)
+{
+    syscall(SYS_futex, word, FUTEX_WAIT, value, timeout, NULL, 0);
+}
+
+static void futex_wake(_Atomic uint32_t *word, int count)
+{
+    syscall(SYS_futex, word, FUTEX_WAKE, count, NULL, NULL, 0);
+}
+
+/*A deque never holds more than all slots, so the positions index a ring of slot_count entries*/
+static void push(pool_t *p, deque_t *d, uint32_t slot)
+{
+    pthread_mutex_lock(&d->lock);
+    d->slots[d->bottom++ % p->slot_count] = slot;
+    pthread_mutex_unlock(&d->lock);
+}
+
+static bool pop(pool_t *p, deque_t *d, uint32_t *slot)
+{
+    bool found = false;
+    pthread_mutex_lock(&d->lock);
+    if (d->bottom != d->top)
+    {
+        *slot = d->slots[--d->bottom % p->slot_count];
+        found = true;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return found;
+}
+
+static bool steal(pool_t *p, deque_t *d, uint32_t *slot)
+{
+    bool found = false;
+    /*Thieves do not wait for a busy deque*/
+    if (pthread_mutex_trylock(&d->lock) != 0)
+        return false;
+    if (d->bottom != d->top)
+    {
+        *slot = d->slots[d->top++ % p->slot_count];
+        found = true;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return found;
+}
+
+static bool claim(pool_t *p, uint32_t slot)
+{
+    uint8_t free_slot = 0;
+    return atomic_compare_exchange_strong(&p->claimed[slot], &free_slot, 1);
+}
+
+/*Claims every slot with a waiting request, starting at the slots of the worker*/
+static uint32_t scan(pool_t *p, uint32_t worker)
+{
+    uint32_t found = 0;
+    uint32_t start = (uint64_t)worker * p->slot_count / p->worker_count;
+    for (uint32_t i = 0; i < p->slot_count; i++)
+    {
+        uint32_t slot = (start + i) % p->slot_count;
+        if (!atomic_load_explicit(&p->claimed[slot], memory_order_relaxed) && p->ops->ready(p->first_slot + slot) && claim(p, slot))
+        {
+            push(p, &p->deques[worker], slot);
+            found++;
+        }
+    }
+    return found;
+}
+
+static bool find_work(pool_t *p, uint32_t worker, uint32_t *slot)
+{
+    if (pop(p, &p->deques[worker], slot))
+        return true;
+    for (uint32_t i = 1; i < p->worker_count; i++)
+    {
+        if (steal(p, &p->deques[(worker + i) % p->worker_count], slot))
+            return true;
+    }
+    uint32_t found = scan(p, worker);
+    /*Others can steal what this worker cannot serve right away*/
+    if (found > 1 && atomic_load(p->sleepers) > 0)
+        futex_wake(p->doorbell, found - 1);
+    return found > 0 && pop(p, &p->deques[worker], slot);
+}
+
+static void check_slots(pool_t *p)
+{
+    if (p->ops->check == NULL)
+        return;
+    for (uint32_t slot = 0; slot < p->slot_count; slot++)
+    {
+        if (claim(p, slot))
+        {
+            p->ops->check(p->first_slot + slot);
+            atomic_store(&p->claimed[slot], 0);
+        }
+    }
+}
+
+static void *worker_function(void *args)
+{
+    worker_t *w = args;
+    pool_t *p = w->pool;
+    while (atomic_load(&p->running))
+    {
+        uint32_t seq = atomic_load(p->doorbell);
+        uint32_t slot;
+        if (find_work(p, w->id, &slot))
+        {
+            p->ops->serve(p->first_slot + slot);
+            atomic_store(&p->claimed[slot], 0);
+            continue;
+        }
+        /*Busy poll: a new request changes the doorbell*/
+        uint32_t n = 0;
+        while (n < p->spin && atomic_load_explicit(p->doorbell, memory_order_relaxed) == seq)
+        {
+            cpu_relax();
+            n++;
+        }
+        if (n < p->spin)
+            continue;
+        /*The clients ring the doorbell after their request is visible, so a request
+          made after the scan changed seq or sees this worker sleeping*/
+        atomic_fetch_add(p->sleepers, 1);
+        if (atomic_load(p->doorbell) == seq && atomic_load(&p->running))
+        {
+            struct timespec timeout = {.tv_sec = POOL_CHECK_INTERVAL};
+            futex_wait(p->doorbell, seq, &timeout);
+            if (atomic_load(p->doorbell) == seq)
+                check_slots(p);
+        }
+        atomic_fetch_sub(p->sleepers, 1);
+    }
+    return NULL;
+}
+
+void pin_thread(pthread_t thread, uint32_t core)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(core % sysconf(_SC_NPROCESSORS_ONLN), &set);
+    pthread_setaffinity_np(thread, sizeof(set), &set);
+}
+
+pool_t *pool_create(uint32_t workers, uint32_t first_slot, uint32_t slots, const pool_ops_t *ops,
+                    _Atomic uint32_t *doorbell, _Atomic uint32_t *sleepers,
+                    uint32_t spin, int first_core)
+{
+    pool_t *p = calloc(1, sizeof(pool_t));
+    if (p == NULL)
+        return NULL;
+    p->ops = ops;
+    p->worker_count = workers;
+    p->first_slot = first_slot;
+    p->slot_count = slots;
+    p->doorbell = doorbell;
+    p->sleepers = sleepers;
+    p->spin = spin;
+    p->running = 1;
+    p->claimed = calloc(slots, sizeof(_Atomic uint8_t));
+    p->deques = aligned_alloc(64, sizeof(deque_t) * workers);
+    p->workers = calloc(workers, sizeof(worker_t));
+    if (p->claimed == NULL || p->deques == NULL || p->workers == NULL)
+    {
+        free((void *)p->claimed);
+        free(p->deques);
+        free(p->workers);
+        free(p);
+        return NULL;
+    }
+    for (uint32_t i = 0; i < workers; i++)
+    {
+        pthread_mutex_init(&p->deques[i].lock, NULL);
+        p->deques[i].top = p->deques[i].bottom = 0;
+        p->deques[i].slots = malloc(sizeof(uint32_t) * slots);
+        if (p->deques[i].slots == NULL)
+        {
+            for (uint32_t j = 0; j <= i; j++)
+            {
+                pthread_mutex_destroy(&p->deques[j].lock);
+                free(p->deques[j].slots);
+            }
+            free((void *)p->claimed);
+            free(p->deques);
+            free(p->workers);
+            free(p);
+            return NULL;
+        }
+    }
+    for (uint32_t i = 0; i < workers; i++)
+    {
+        p->workers[i] = (worker_t){.pool = p, .id = i};
+        pthread_create(&p->workers[i].thread, NULL, worker_function, &p->workers[i]);
+        if (first_core >= 0)
+            pin_thread(p->workers[i].thread, first_core + i);
+    }
+    return p;
+}
+
+void pool_stop(pool_t *p)
+{
+    atomic_store(&p->running, 0);
+    atomic_fetch_add(p->doorbell, 1);
+    futex_wake(p->doorbell, INT_MAX);
+}
+
+void pool_destroy(pool_t *p)
+{
+    for (uint32_t i = 0; i < p->worker_count; i++)
+        pthread_join(p->workers[i].thread, NULL);
+    for (uint32_t i = 0; i < p->worker_count; i++)
+    {
+        pthread_mutex_destroy(&p->deques[i].lock);
+        free(p->deques[i].slots);
+    }
+    free(p->deques);
+    free(p->workers);
+    free((void *)p->claimed);
+    free(p);
+}
@@ -0,0 +1,48 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+/*
+Pool of workers serving a range of slots. A worker that finds slots with waiting requests
+claims them and puts them into its own deque, it serves them newest first while
+idle workers steal the oldest ones. Workers without work sleep on a doorbell
+futex the clients ring after making a request.
+*/
+
+typedef struct pool_ops
+{
+    /*Returns true if the slot has a waiting request, may be called for claimed slots*/
+    bool (*ready)(uint32_t slot);
+    /*Serves the waiting requests of a claimed slot*/
+    void (*serve)(uint32_t slot);
+    /*Called for every slot that is not served after a worker was idle for a second*/
+    void (*check)(uint32_t slot);
+} pool_ops_t;
+
+typedef struct pool pool_t;
+
+/*
+doorbell and sleepers are shared with the clients, see notify_workers.
+The pool serves the slots first_slot to first_slot + slots - 1.
+A worker without work checks the doorbell spin times before it sleeps.
+With first_core >= 0 worker i is pinned to core first_core + i.
+Returns NULL if the pool cannot be allocated.
+*/
+pool_t *pool_create(uint32_t workers, uint32_t first_slot, uint32_t slots, const pool_ops_t *ops,
+                    _Atomic uint32_t *doorbell, _Atomic uint32_t *sleepers,
+                    uint32_t spin, int first_core);
+
+/*Wakes all workers and lets them return, can be called from a signal handler*/
+void pool_stop(pool_t *p);
+
+/*Pins a thread to a core, cores beyond the number of cores wrap around*/
+void pin_thread(pthread_t thread, uint32_t core);
+
+/*Waits for the workers to return and frees the pool*/
+void pool_destroy(pool_t *p);
+
+#endif
@@ -0,0 +1,134 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include "ring.h"
+
+/*Type of the record filling the end of the ring, request types start at 1*/
+#define RING_PAD 0
+
+/*The futexes are shared between processes, so they are not private*/
+static void futex_wait(_Atomic uint32_t *word, uint32_t value)
+{
+    syscall(SYS_futex, word, FUTEX_WAIT, value, NULL, NULL, 0);
+}
+
+static void futex_wake(_Atomic uint32_t *word)
+{
+    syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+uint32_t ring_spin = RING_SPIN;
+
+void ring_set_spin(uint32_t spin)
+{
+    ring_spin = spin;
+}
+
+static inline uint32_t record_size(uint32_t length)
+{
+    return (sizeof(ring_record_t) + length + RING_RECORD_ALIGN - 1) & ~(RING_RECORD_ALIGN - 1);
+}
+
+void ring_init(ring_t *r)
+{
+    memset(r, 0, sizeof(ring_t) - RING_SIZE);
+}
+
+ring_record_t *ring_reserve(ring_t *r, uint32_t length)
+{
+    uint32_t size = record_size(length);
+    uint32_t position = r->reserved % RING_SIZE;
+    /*Records do not wrap around, the rest of the ring is skipped instead*/
+    uint32_t pad = RING_SIZE - position < size ? RING_SIZE - position : 0;
+    uint32_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+    if (size > RING_SIZE || r->reserved + pad + size - head > RING_SIZE)
+        return NULL;
+    if (pad > 0)
+    {
+        ring_record_t *p = (ring_record_t *)(r->data + position);
+        p->size = pad;
+        p->type = RING_PAD;
+        r->reserved += pad;
+        position = 0;
+    }
+    ring_record_t *record = (ring_record_t *)(r->data + position);
+    record->size = size;
+    r->reserved += size;
+    return record;
+}
+
+void ring_publish(ring_t *r)
+{
+    if (atomic_load_explicit(&r->tail, memory_order_relaxed) == r->reserved)
+        return;
+    atomic_store(&r->tail, r->reserved);
+    if (atomic_load(&r->consumer_waiting))
+        futex_wake(&r->tail);
+}
+
+ring_record_t *ring_peek(ring_t *r)
+{
+    uint32_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    while (r->consumed != tail)
+    {
+        ring_record_t *record = (ring_record_t *)(r->data + r->consumed % RING_SIZE);
+        if (record->type != RING_PAD)
+            return record;
+        r->consumed += record->size;
+    }
+    return NULL;
+}
+
+void ring_consume(ring_t *r)
+{
+    ring_record_t *record = (ring_record_t *)(r->data + r->consumed % RING_SIZE);
+    r->consumed += record->size;
+}
+
+void ring_release(ring_t *r)
+{
+    if (atomic_load_explicit(&r->head, memory_order_relaxed) == r->consumed)
+        return;
+    atomic_store(&r->head, r->consumed);
+    if (atomic_load(&r->producer_waiting))
+        futex_wake(&r->head);
+}
+
+/*Spins and then sleeps until word differs from value.
+  The waiting flag is set before the last check, the other side
+  checks it after its store, so no wake up is lost*/
+static void ring_wait(ring_t *r, _Atomic uint32_t *word, uint32_t value, _Atomic uint32_t *waiting)
+{
+    for (uint32_t i = 0; i < ring_spin; i++)
+    {
+        if (atomic_load_explicit(word, memory_order_acquire) != value || atomic_load_explicit(&r->closed, memory_order_relaxed))
+            return;
+        cpu_relax();
+    }
+    atomic_store(waiting, 1);
+    while (atomic_load(word) == value && !atomic_load(&r->closed))
+        futex_wait(word, value);
+    atomic_store(waiting, 0);
+}
+
+void ring_wait_data(ring_t *r)
+{
+    ring_wait(r, &r->tail, r->consumed, &r->consumer_waiting);
+}
+
+void ring_wait_space(ring_t *r, uint32_t head)
+{
+    ring_wait(r, &r->head, head, &r->producer_waiting);
+}
+
+void ring_close(ring_t *r)
+{
+    atomic_store(&r->closed, 1);
+    futex_wake(&r->tail);
+    futex_wake(&r->head);
+}
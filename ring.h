@@ -0,0 +1,74 @@
+#ifndef RING_H
+#define RING_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+/*
+Single producer, single consumer ring of variable sized records in shared memory.
+The producer reserves records and makes them visible in bursts with ring_publish,
+the consumer reads them in place and frees their space with ring_release.
+A side that has to wait spins for a while and then sleeps on a futex.
+*/
+
+/*Bytes of record data in every ring, has to be a power of two*/
+#ifndef RING_SIZE
+#define RING_SIZE (256 * 1024)
+#endif
+#define RING_RECORD_ALIGN 8
+/*Checks before a waiting side goes to sleep*/
+#define RING_SPIN 2000
+
+static inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+typedef struct ring_record
+{
+    /*Bytes of the whole record including the header*/
+    uint32_t size;
+    uint32_t type;
+    uint32_t key;
+    uint32_t length;
+    uint64_t tag;
+    uint8_t data[];
+} ring_record_t;
+
+typedef struct ring
+{
+    /*Written by the producer*/
+    _Atomic uint32_t tail;
+    uint32_t reserved;
+    _Atomic uint32_t producer_waiting;
+    /*Written by the consumer*/
+    _Atomic uint32_t head __attribute__((aligned(64)));
+    uint32_t consumed;
+    _Atomic uint32_t consumer_waiting;
+    _Atomic uint32_t closed __attribute__((aligned(64)));
+    uint8_t data[RING_SIZE] __attribute__((aligned(64)));
+} ring_t;
+
+void ring_init(ring_t *r);
+/*Returns a record with room for length bytes of data or NULL if the ring is full*/
+ring_record_t *ring_reserve(ring_t *r, uint32_t length);
+/*Makes all reserved records visible to the consumer*/
+void ring_publish(ring_t *r);
+/*Returns the next published record or NULL*/
+ring_record_t *ring_peek(ring_t *r);
+/*Moves past the record returned by ring_peek*/
+void ring_consume(ring_t *r);
+/*Gives the space of all consumed records back to the producer*/
+void ring_release(ring_t *r);
+/*Waits until a record was published after the consumed ones or the ring was closed*/
+void ring_wait_data(ring_t *r);
+/*Waits until the consumer released space after head was read or the ring was closed*/
+void ring_wait_space(ring_t *r, uint32_t head);
+/*Sets the number of checks before a waiting side goes to sleep, RING_SPIN by default*/
+void ring_set_spin(uint32_t spin);
+/*Wakes all waiters, the ring can not be used afterwards*/
+void ring_close(ring_t *r);
+
+#endif
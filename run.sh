@@ -1,4 +1,7 @@
-./${1} &
+server=${1}
+client=${2}
+shift 2
+./${server} "$@" &
 server_pid=$! 
-(./${2} & ./${2} & ./${2} & ./${2} & ./${2} & ./${2} & wait)
+(./${client} & ./${client} & ./${client} & ./${client} & ./${client} & ./${client} & wait)
 kill -2 $server_pid
\ No newline at end of file
@@ -11,249 +11,563 @@
 #include <string.h>
 #include <stdatomic.h>
 #include <signal.h>
+#include <getopt.h>
 #include "exchange.h"
+#include "table.h"
+#include "pool.h"
+#include "snapshot.h"
+#include "wal.h"
+#include "cache.h"
 #ifdef USECUSTOMMALLOC
 #include "alloc.h"
+#else
+#include <malloc.h>
 #endif
-#ifndef DONTPRINTEND
-int total = 0;
-#endif
-
-typedef struct hash_table_entry
-{
-    uint32_t key;
-    void *obj;
-    uint32_t obj_length;
-    struct hash_table_entry *next;
-} entry_t;
-
-typedef struct hash_table_entry_data
-{
-    entry_t entry;
-    pthread_rwlock_t rwlock;
-} entry_data_t;
-
-typedef struct hashtable
-{
-    uint32_t table_size;
-    entry_data_t table[];
-} hashtable_t;
 
-hashtable_t *table;
+const table_engine_t *engine = &chain_engine;
+/*One table per partition*/
+void **tables;
+uint32_t partitions = 1;
 m_t *memory;
 static volatile int running = 1;
+transport_type transport = TRANSPORT_SLOT;
+uint32_t slot_count = CLIENT_SLOTS;
+uint32_t slot_words = MAX_TRANSMISSION_SIZE;
+/*Size of the payload arena in KiB, 0 for ARENA_SLOT_KIB per slot*/
+uint32_t arena_kib = 0;
+#define ARENA_SLOT_KIB 4
+/*Slots are served by a pool of workers instead of a thread each*/
+bool use_pool = false;
+/*Workers of every partition, 0 for the cores split over the partitions*/
+uint32_t pool_workers = 0;
+pool_t **pools = NULL;
+/*Busy poll: checks of a slot before a waiting thread sleeps, threads are pinned from first_core on*/
+uint32_t spin = 0;
+int first_core = -1;
+/*Completions are published at least this often while a burst is processed*/
+#define RING_BURST 64
+/*Seconds an idle slot waits before it checks whether its client is still alive*/
+#define RECLAIM_INTERVAL 1
+/*File the tables are written to on SIGUSR2 and at exit and served from at start, NULL without snapshots*/
+const char *snapshot_path = NULL;
+snapshot_t *snapshot = NULL;
+/*Tables of snapshot_engine the snapshot is loaded into, tables may wrap them*/
+void **overlays = NULL;
+/*Only one snapshot is written at a time*/
+pthread_mutex_t snapshot_lock = PTHREAD_MUTEX_INITIALIZER;
+/*Log of the inserts and deletes, NULL without -W. A batch of records is written
+  commit_us after its first record or once it has commit_kib KiB*/
+const char *wal_path = NULL;
+wal_t *wal = NULL;
+uint32_t commit_us = 0;
+uint32_t commit_kib = 256;
+/*Number of the last log record in the tables*/
+uint64_t log_sequence = 0;
+/*Memory budget of all tables in MiB and seconds a key lives after its last insert,
+  0 for none. The tables are wrapped in caches if either is set*/
+uint32_t budget_mib = 0;
+uint32_t ttl = 0;
+void **cache_tables = NULL;
+/*The sweeper looks at CACHE_SWEEP_KEYS keys of every stripe each CACHE_SWEEP_MS*/
+#define CACHE_SWEEP_MS 10
+#define CACHE_SWEEP_KEYS 256
+
+/*Writes the tables to snapshot_path while the requests are still served.
+  With a log the writers wait meanwhile, so the snapshot ends exactly at a log record*/
+static void write_snapshot(void)
+{
+    pthread_mutex_lock(&snapshot_lock);
+    uint64_t sequence = wal != NULL ? wal_pause(wal) : log_sequence;
+    int64_t count = snapshot_write(engine, tables, partitions, snapshot_path, sequence);
+    if (wal != NULL)
+        wal_resume(wal, sequence, count >= 0);
+    pthread_mutex_unlock(&snapshot_lock);
+    if (count < 0)
+        fprintf(stderr, "Failed to write snapshot %s\n", snapshot_path);
+    else
+        fprintf(stderr, "Snapshot of %ld entries written to %s\n", count, snapshot_path);
+}
 
-hashtable_t *create_hashtable(uint32_t size)
+/*Statistics are printed whenever the server receives SIGUSR1, a snapshot is written on SIGUSR2*/
+void *signal_function(void *args)
 {
-    hashtable_t *t = malloc(sizeof(hashtable_t) + sizeof(entry_data_t) * size);
-    memset(t, 0, sizeof(hashtable_t) + sizeof(entry_data_t) * size);
-    t->table_size = size;
-    for (int i = 0; i < size; i++)
+    sigset_t *set = args;
+    int sig;
+    while (sigwait(set, &sig) == 0)
     {
-        pthread_rwlock_init(&t->table[i].rwlock, NULL);
+        if (sig == SIGUSR2)
+        {
+            if (snapshot_path != NULL)
+                write_snapshot();
+            continue;
+        }
+        fprintf(stderr, "--- Allocator ---\n");
+#ifdef USECUSTOMMALLOC
+        alloc_print_stats(stderr);
+#else
+        malloc_stats();
+#endif
+        for (uint32_t i = 0; i < partitions; i++)
+        {
+            fprintf(stderr, "--- Hash table %u ---\n", i);
+            engine->print_stats(tables[i], stderr);
+        }
     }
-    return t;
+    return NULL;
 }
 
-void clear_entry_list(entry_t *curr)
+/*Computes the layout of the shared memory and returns its size*/
+size_t layout_memory_region(m_t *r)
 {
-    for (entry_t *n = curr; n != NULL; n = n->next)
+    *r = (m_t){.magic = SHM_MAGIC, .version = SHM_VERSION, .slot_count = slot_count, .partitions = partitions,
+               .ring_size = RING_SIZE, .transport = transport, .max_words = slot_words,
+               .workers = use_pool ? pool_workers : 0, .spin = spin, .shared_table = engine == &shared_engine};
+    r->slot_size = sizeof(exchange_t);
+    r->doorbells_offset = (sizeof(m_t) + 63) & ~(size_t)63;
+    r->slots_offset = r->doorbells_offset + partitions * sizeof(doorbell_t);
+    r->arena_offset = r->slots_offset + (uint64_t)slot_count * partitions * r->slot_size;
+    /*The arena holds at least the largest request*/
+    uint64_t arena_bytes = (uint64_t)(arena_kib != 0 ? arena_kib : slot_count * partitions * ARENA_SLOT_KIB) * 1024;
+    arena_bytes = arena_bytes > slot_words * sizeof(uint32_t) ? arena_bytes : slot_words * sizeof(uint32_t);
+    uint32_t pages = (arena_bytes + ARENA_PAGE - 1) / ARENA_PAGE;
+    r->pages_offset = (r->arena_offset + arena_size(pages) + 63) & ~(size_t)63;
+    r->total_size = r->pages_offset + (uint64_t)pages * ARENA_PAGE;
+    if (transport == TRANSPORT_RING)
     {
-        free(n->obj);
+        r->rings_offset = r->total_size;
+        r->total_size += (uint64_t)slot_count * partitions * sizeof(ring_pair_t);
     }
+    return r->total_size;
 }
 
-void clear_entries(entry_t *curr)
+void init_memory_region(m_t *r, m_t *layout)
 {
-    void *tmp = NULL;
-    for (; curr != NULL; curr = curr->next)
+    *r = *layout;
+    uint64_t pages_end = r->rings_offset != 0 ? r->rings_offset : r->total_size;
+    arena_init(get_arena(r), (pages_end - r->pages_offset) / ARENA_PAGE);
+    r->client_count = 0;
+    memset(get_doorbell(r, 0), 0, r->partitions * sizeof(doorbell_t));
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&r->id_lock, &attr);
+
+    pthread_condattr_t condattr;
+    pthread_condattr_init(&condattr);
+    pthread_condattr_setpshared(&condattr, PTHREAD_PROCESS_SHARED);
+    pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
+
+    for (uint32_t i = 0; i < r->slot_count * r->partitions; i++)
     {
-        free(tmp);
-#ifndef DONTPRINTEND
-        total++;
-#endif
-        tmp = NULL;
-        tmp = curr;
+        exchange_t *e = get_slot(r, i);
+        pthread_mutex_init(&e->rw, &attr);
+        pthread_mutex_init(&e->cond_mutex, &attr);
+        pthread_cond_init(&e->cond, &condattr);
+        e->type = NO_REQUEST;
+        e->owner = 0;
+        e->payload = 0;
+        e->capacity = 0;
+        if (r->transport == TRANSPORT_RING)
+        {
+            ring_init(&get_rings(r, i)->submit);
+            ring_init(&get_rings(r, i)->complete);
+        }
     }
-    free(tmp);
+
+    pthread_mutexattr_destroy(&attr);
+    pthread_condattr_destroy(&condattr);
 }
 
-void clear_hashtable(hashtable_t *t)
+
+/*Value that is streamed into a slot*/
+typedef struct stream
 {
-    for (int i = 0; i < t->table_size; i++)
+    uint32_t key;
+    uint32_t total;
+    uint32_t received;
+    uint8_t *data;
+} stream_t;
+
+/*Streams of the slots, a slot can be served by different workers of the pool*/
+stream_t *streams;
+
+/*
+Frees lease i if its client died. The condition variables of its control blocks may
+still count the dead client as a waiter, so they are initialized again. No other
+client uses them while the lease is held and no server thread waits on them meanwhile.
+*/
+static void reclaim_lease(uint32_t i)
+{
+    exchange_t *lease = get_slot(memory, i);
+    pid_t owner = atomic_load(&lease->owner);
+    if (owner == 0 || kill(owner, 0) == 0 || errno != ESRCH)
+        return;
+    pthread_condattr_t condattr;
+    pthread_condattr_init(&condattr);
+    pthread_condattr_setpshared(&condattr, PTHREAD_PROCESS_SHARED);
+    pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
+    for (uint32_t p = 0; p < memory->partitions; p++)
     {
-        clear_entry_list(&t->table[i].entry);
-        clear_entries(t->table[i].entry.next);
+        uint32_t id = p * memory->slot_count + i;
+        exchange_t *e = get_slot(memory, id);
+        lock_robust(&e->cond_mutex);
+        pthread_cond_init(&e->cond, &condattr);
+        free(streams[id].data);
+        streams[id].data = NULL;
+        /*The pages of the client go back to the arena*/
+        if (e->capacity > 0 && payload_valid(memory, e))
+            arena_free(get_arena(memory), e->payload, SLOT_BYTES(e) / ARENA_PAGE);
+        e->capacity = 0;
+        e->type = NO_REQUEST;
+        pthread_mutex_unlock(&e->cond_mutex);
     }
+    pthread_condattr_destroy(&condattr);
+    atomic_store(&lease->owner, 0);
 }
 
-void insert(hashtable_t *t, uint32_t key, void *data, uint32_t data_length)
+/*With a log, a client is only answered once its changes are durable*/
+static void commit_log(void)
 {
+    if (wal != NULL)
+        wal_commit(wal);
+}
 
-    uint32_t position = key % t->table_size;
-    pthread_rwlock_wrlock(&t->table[position].rwlock);
-    if (t->table[position].entry.obj == NULL)
+/*Appends a chunk to the value of the slot, which is allocated once
+  with its full size and handed to the table without another copy*/
+static bool stream_insert(void *table, stream_t *stream, exchange_t *e, uint32_t *data)
+{
+    if (e->offset == 0)
     {
-        t->table[position].entry.key = key;
-        t->table[position].entry.obj = data;
-        t->table[position].entry.obj_length = data_length;
-        pthread_rwlock_unlock(&t->table[position].rwlock);
-        return;
+        free(stream->data);
+        *stream = (stream_t){.key = e->key, .total = e->total, .received = 0};
+        stream->data = malloc(e->total);
     }
-
-    entry_t *current = &t->table[position].entry;
-    for (; current->next != NULL; current = current->next);
-    current->next = malloc(sizeof(entry_t));
-    current = current->next;
-    current->key = key;
-    current->next = NULL;
-    current->obj = data;
-    current->obj_length = data_length;
-
-    pthread_rwlock_unlock(&t->table[position].rwlock);
+    if (stream->data == NULL || stream->key != e->key || stream->received != e->offset ||
+        e->length > stream->total - stream->received || e->length > SLOT_BYTES(e))
+        return false;
+    memcpy(stream->data + e->offset, data, e->length);
+    stream->received += e->length;
+    if (stream->received == stream->total)
+    {
+        engine->insert_owned(table, stream->key, stream->data, stream->total);
+        stream->data = NULL;
+    }
+    return true;
 }
 
-entry_t read_table(hashtable_t *t, uint32_t key)
+/*Serves the request waiting in a slot, cond_mutex has to be held*/
+static void serve_request(uint32_t id)
 {
-    uint32_t position = key % t->table_size;
-    pthread_rwlock_rdlock(&t->table[position].rwlock);
-    entry_t r;
-    for (entry_t *current = &t->table[position].entry; current != NULL; current = current->next)
+    exchange_t *e = get_slot(memory, id);
+    void *table = tables[id / memory->slot_count];
+    int64_t length;
+    uint32_t count, pos;
+    uint32_t *keys;
+    /*The client may have taken other pages since its last request*/
+    uint32_t *data = get_payload(memory, e);
+    uint32_t words = e->capacity < memory->max_words ? e->capacity : memory->max_words;
+    switch (payload_valid(memory, e) ? e->type : NO_REQUEST)
     {
-        if (current->key == key)
+    case NO_REQUEST:
+        fprintf(stderr, "Payload outside of the arena received on Position %d\n", id);
+        e->length = 0;
+        break;
+
+    case REQUEST_INSERT:
+        engine->insert(table, e->key, data, e->length < SLOT_BYTES(e) ? e->length : SLOT_BYTES(e));
+        break;
+
+    case REQUEST_DELETE:
+        if (!engine->delete(table, e->key))
+            fprintf(stderr, "Element not found %d %d\n", e->key, id);
+        break;
+
+    case REQUEST_READ:
+        /*The value is copied straight into the payload*/
+        length = engine->read(table, e->key, 0, data, SLOT_BYTES(e));
+        e->length = length < 0 ? 0 : length;
+
+        break;
+
+    case REQUEST_MULTI_INSERT:
+        count = e->key;
+        pos = 0;
+        for (uint32_t n = 0; n < count && pos + 2 <= words; n++)
         {
-            r = *current;
-            r.obj = malloc(r.obj_length);
-            memcpy(r.obj, current->obj, r.obj_length);
-            pthread_rwlock_unlock(&t->table[position].rwlock);
-            return r;
+            uint32_t value_length = data[pos + 1];
+            /*Checked before BATCH_WORDS, which wraps for lengths close to UINT32_MAX*/
+            if (value_length > (uint64_t)(words - pos - 2) * sizeof(uint32_t))
+                break;
+            engine->insert(table, data[pos], &data[pos + 2], value_length);
+            pos += 2 + BATCH_WORDS(value_length);
         }
-    }
-    pthread_rwlock_unlock(&t->table[position].rwlock);
-    return (entry_t){.obj = NULL, .obj_length = 0};
-}
+        break;
 
-void *delete(hashtable_t *t, uint32_t key)
-{
-
-    uint32_t position = key % t->table_size;
-    void *r;
-    pthread_rwlock_wrlock(&t->table[position].rwlock);
-    if (t->table[position].entry.key == key && t->table[position].entry.obj != NULL)
-    {
-        r = t->table[position].entry.obj;
-        if (t->table[position].entry.next != NULL)
+    case REQUEST_MULTI_READ:
+        /*The results overwrite the keys, so they are copied first*/
+        count = e->key < words ? e->key : words;
+        keys = malloc(count * sizeof(uint32_t));
+        if (keys == NULL && count > 0)
         {
-            entry_t *next = t->table[position].entry.next;
-            t->table[position].entry = *next;
-            free(next);
+            fprintf(stderr, "Could not copy the keys of a batch read on Position %d\n", id);
+            e->key = 0;
+            e->length = 0;
+            break;
         }
-        else
+        memcpy(keys, data, count * sizeof(uint32_t));
+        pos = 0;
+        e->key = 0;
+        for (uint32_t n = 0; n < count && pos < words; n++)
         {
-            t->table[position].entry = (entry_t){.obj = NULL, .obj_length = 0};
+            uint32_t capacity = (words - pos - 1) * sizeof(uint32_t);
+            length = engine->read(table, keys[n], 0, &data[pos + 1], capacity);
+            if (length > capacity)
+                break;
+            data[pos] = length < 0 ? BATCH_MISSING : length;
+            pos += 1 + (length < 0 ? 0 : BATCH_WORDS(length));
+            e->key++;
         }
-        pthread_rwlock_unlock(&t->table[position].rwlock);
-
-        return r;
-    }
-
-    for (entry_t *current = &t->table[position].entry; current->next != NULL; current = current->next)
-    {
-        if (current->next->key == key)
+        e->length = pos * sizeof(uint32_t);
+        free(keys);
+        break;
+
+    case REQUEST_MULTI_DELETE:
+        count = e->key < words ? e->key : words;
+        e->length = 0;
+        for (uint32_t n = 0; n < count; n++)
+            e->length += engine->delete(table, data[n]);
+        break;
+
+    case REQUEST_STREAM_INSERT:
+        if (!stream_insert(table, &streams[id], e, data))
         {
-            entry_t *next = current->next;
-            r = next->obj;
-            current->next = current->next->next;
-            pthread_rwlock_unlock(&t->table[position].rwlock);
-            free(next);
-            return r;
+            fprintf(stderr, "Unexpected chunk of key %u at %u received on Position %d\n", e->key, e->offset, id);
+            e->length = 0;
         }
-    }
+        break;
 
-    pthread_rwlock_unlock(&t->table[position].rwlock);
-    return NULL;
-}
+    case REQUEST_STREAM_READ:
+        length = engine->read(table, e->key, e->offset, data, SLOT_BYTES(e));
+        e->total = length < 0 ? BATCH_MISSING : length;
+        e->length = length < 0 || length <= e->offset ? 0 : length - e->offset;
+        e->length = e->length < SLOT_BYTES(e) ? e->length : SLOT_BYTES(e);
+        break;
 
-void init_memory_region(m_t *r, size_t size)
-{
-    r->client_count = 0;
-    pthread_mutexattr_t attr;
-    pthread_mutexattr_init(&attr);
-    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
-    pthread_mutex_init(&r->id_lock, &attr);
-
-    pthread_condattr_t condattr;
-    pthread_condattr_init(&condattr);
-    pthread_condattr_setpshared(&condattr, PTHREAD_PROCESS_SHARED);
-
-    for (int i = 0; i < CLIENT_SLOTS; i++)
-    {
-        pthread_mutex_init(&r->c_slots[i].rw, &attr);
-        pthread_mutex_init(&r->c_slots[i].cond_mutex, &attr);
-        pthread_cond_init(&r->c_slots[i].cond, &condattr);
+    default:
+        fprintf(stderr, "Unexpected type (%d) received on Position %d\n", e->type, id);
     }
-
-    pthread_mutexattr_destroy(&attr);
-    pthread_condattr_destroy(&condattr);
+    commit_log();
+    e->type = NO_REQUEST;
+    pthread_cond_signal(&e->cond);
 }
 
-
 /*Function is used for the threads
   Each thread serves one slot in the shared memory
 */
 void *serve_function(void *args)
 {
     uint32_t id = (uintptr_t)args;
-    pthread_mutex_t *cond_mutex = &memory->c_slots[id].cond_mutex;
-    pthread_cond_t *cond = &memory->c_slots[id].cond;
-    exchange_t *e = &memory->c_slots[id];
-    int i = 0;
+    exchange_t *e = get_slot(memory, id);
+    pthread_mutex_t *cond_mutex = &e->cond_mutex;
+    pthread_cond_t *cond = &e->cond;
 
     while (running)
     {
-        pthread_mutex_lock(cond_mutex);
+        /*Busy poll: the client does not hold cond_mutex while it waits for the request to be taken*/
+        for (uint32_t n = 0; n < spin && e->type == NO_REQUEST && running; n++)
+            cpu_relax();
+        lock_robust(cond_mutex);
 
         while (e->type == NO_REQUEST)
         {
-            pthread_cond_wait(cond, cond_mutex);
+            struct timespec timeout;
+            clock_gettime(CLOCK_MONOTONIC, &timeout);
+            timeout.tv_sec += RECLAIM_INTERVAL;
+            int r = pthread_cond_timedwait(cond, cond_mutex, &timeout);
+            /*A client died while it held the mutex*/
+            if (r == EOWNERDEAD)
+                pthread_mutex_consistent(cond_mutex);
+            if (r == ETIMEDOUT)
+            {
+                pthread_mutex_unlock(cond_mutex);
+                reclaim_lease(id);
+                lock_robust(cond_mutex);
+            }
             if (!running)
             {
                 pthread_mutex_unlock(cond_mutex);
                 return NULL;
             }
         }
-        void *data;
-        entry_t entry;
-        switch (e->type)
-        {
-        case REQUEST_INSERT:
-            data = malloc(e->length);
-            memcpy(data, e->data, e->length);
-            insert(table, e->key, data, e->length);
+        serve_request(id);
+        pthread_mutex_unlock(cond_mutex);
+    }
+    return NULL;
+}
+
+/*Returns space for the completion of a request,
+  handing everything done so far to the client while it waits*/
+static ring_record_t *reserve_completion(ring_t *sq, ring_t *cq, uint32_t length)
+{
+    ring_record_t *c;
+    while ((c = ring_reserve(cq, length)) == NULL)
+    {
+        uint32_t head = atomic_load(&cq->head);
+        commit_log();
+        ring_publish(cq);
+        ring_release(sq);
+        if ((c = ring_reserve(cq, length)) != NULL || !running)
             break;
+        ring_wait_space(cq, head);
+    }
+    return c;
+}
 
-        case REQUEST_DELETE:
-            data = delete (table, e->key);
-            if (data == NULL)
-                fprintf(stderr, "Element not found %d %d\n", e->key, id);
-            free(data);
+/*Serves the requests waiting in the rings of one slot, they are handled
+  in bursts without waking the client in between*/
+/*Records are written by the client, the value of an insert has to lie within its record*/
+static bool record_valid(const ring_t *ring, const ring_record_t *r)
+{
+    uint32_t room = RING_SIZE - (uint32_t)((const uint8_t *)r - ring->data);
+    return r->size >= sizeof(ring_record_t) && r->size <= room && r->length <= r->size - sizeof(ring_record_t);
+}
+
+static void serve_rings(uint32_t id)
+{
+    ring_t *sq = &get_rings(memory, id)->submit;
+    ring_t *cq = &get_rings(memory, id)->complete;
+    void *table = tables[id / memory->slot_count];
+    ring_record_t *r;
+    for (uint32_t n = 1; running && (r = ring_peek(sq)) != NULL; n++)
+    {
+        uint32_t capacity = r->type == REQUEST_READ ? r->length : 0;
+        capacity = capacity < RING_SIZE / 4 ? capacity : RING_SIZE / 4;
+        ring_record_t *c = reserve_completion(sq, cq, capacity);
+        if (c == NULL)
+            break;
+        c->type = r->type;
+        c->key = r->key;
+        c->tag = r->tag;
+        c->length = 0;
+        int64_t length;
+        switch (r->type)
+        {
+        case REQUEST_INSERT:
+            if (!record_valid(sq, r))
+            {
+                fprintf(stderr, "Value of key %u exceeds its record on Position %d\n", r->key, id);
+                c->length = BATCH_MISSING;
+                break;
+            }
+            engine->insert(table, r->key, r->data, r->length);
             break;
 
         case REQUEST_READ:
-            entry = read_table(table, e->key);
-            memcpy(e->data, entry.obj, entry.obj_length);
-            free(entry.obj);
-            e->length = entry.obj_length;
+            length = engine->read(table, r->key, 0, c->data, capacity);
+            c->length = length < 0 ? BATCH_MISSING : length;
+            break;
 
+        case REQUEST_DELETE:
+            c->length = engine->delete(table, r->key);
+            if (!c->length)
+                fprintf(stderr, "Element not found %d %d\n", r->key, id);
             break;
 
         default:
-            fprintf(stderr, "Unexpected type (%d) received on Position %d\n", e->type, id);
+            fprintf(stderr, "Unexpected type (%d) received on Position %d\n", r->type, id);
         }
-        e->type = NO_REQUEST;
+        ring_consume(sq);
+        if (n % RING_BURST == 0)
+        {
+            commit_log();
+            ring_publish(cq);
+            ring_release(sq);
+        }
+    }
+    commit_log();
+    ring_publish(cq);
+    ring_release(sq);
+}
 
-        pthread_cond_signal(cond);
-        pthread_mutex_unlock(cond_mutex);
+/*Serves the rings of one slot*/
+void *serve_ring_function(void *args)
+{
+    uint32_t id = (uintptr_t)args;
+    ring_t *sq = &get_rings(memory, id)->submit;
+
+    while (running)
+    {
+        serve_rings(id);
+        ring_wait_data(sq);
+    }
+    return NULL;
+}
+
+/*Callbacks of the worker pool*/
+static bool slot_ready(uint32_t id)
+{
+    return get_slot(memory, id)->type != NO_REQUEST;
+}
+
+static void serve_slot(uint32_t id)
+{
+    exchange_t *e = get_slot(memory, id);
+    lock_robust(&e->cond_mutex);
+    if (e->type != NO_REQUEST)
+        serve_request(id);
+    pthread_mutex_unlock(&e->cond_mutex);
+}
+
+/*The lease is checked by the pool of the first partition*/
+static void check_slot(uint32_t id)
+{
+    if (id < memory->slot_count)
+        reclaim_lease(id);
+}
+
+static bool rings_ready(uint32_t id)
+{
+    ring_t *sq = &get_rings(memory, id)->submit;
+    return atomic_load_explicit(&sq->tail, memory_order_acquire) != sq->consumed;
+}
+
+static const pool_ops_t slot_pool_ops = {.ready = slot_ready, .serve = serve_slot, .check = check_slot};
+/*Slots of clients that died are taken over by the next client with the ring transport*/
+static const pool_ops_t ring_pool_ops = {.ready = rings_ready, .serve = serve_rings, .check = NULL};
+
+static uint32_t route_key(uint32_t key)
+{
+    return partition_of(partitions, key);
+}
+
+static void replay_record(void *ctx, uint32_t type, uint32_t key, const void *data, uint32_t length)
+{
+    void *table = tables[route_key(key)];
+    if (type == WAL_INSERT)
+        engine->insert(table, key, data, length);
+    else
+        engine->delete(table, key);
+}
+
+/*Moves the entries of the snapshot into the tables while they are served*/
+static void *load_function(void *args)
+{
+    snapshot_load(snapshot, overlays, &running);
+    if (snapshot_remaining(snapshot) == 0)
+        fprintf(stderr, "Snapshot %s loaded\n", snapshot_path);
+    return NULL;
+}
+
+/*Removes expired keys nobody reads and keeps the caches within their budget*/
+static void *sweep_function(void *args)
+{
+    struct timespec interval = {.tv_sec = 0, .tv_nsec = CACHE_SWEEP_MS * 1000000L};
+    while (running)
+    {
+        for (uint32_t i = 0; i < partitions; i++)
+            cache_sweep(cache_tables[i], CACHE_SWEEP_KEYS);
+        nanosleep(&interval, NULL);
     }
     return NULL;
 }
@@ -262,9 +576,16 @@ void stop_exec(int sig)
 {
     pthread_mutex_destroy(&memory->id_lock);
     running = 0;
-    for (int i = 0; i < CLIENT_SLOTS; i++)
+    for (uint32_t i = 0; pools != NULL && i < partitions && pools[i] != NULL; i++)
+        pool_stop(pools[i]);
+    for (uint32_t i = 0; i < memory->slot_count * memory->partitions; i++)
     {
-        pthread_cond_signal(&memory->c_slots[i].cond);
+        pthread_cond_signal(&get_slot(memory, i)->cond);
+        if (memory->transport == TRANSPORT_RING)
+        {
+            ring_close(&get_rings(memory, i)->submit);
+            ring_close(&get_rings(memory, i)->complete);
+        }
     }
     signal(SIGINT, SIG_DFL);
 }
@@ -272,19 +593,114 @@ void stop_exec(int sig)
 int main(int argc, char **argv)
 {
     uint32_t table_size = 100;
-    if (argc < 2)
+    int opt;
+    while ((opt = getopt(argc, argv, "e:t:s:w:a:p:b:c:P:S:W:I:K:M:T:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'e':
+            if (strcmp(optarg, chain_engine.name) == 0)
+                engine = &chain_engine;
+            else if (strcmp(optarg, swiss_engine.name) == 0)
+                engine = &swiss_engine;
+            else if (strcmp(optarg, shared_engine.name) == 0)
+                engine = &shared_engine;
+            else
+            {
+                fprintf(stderr, "Unknown table engine %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 't':
+            if (strcmp(optarg, "slot") == 0)
+                transport = TRANSPORT_SLOT;
+            else if (strcmp(optarg, "ring") == 0)
+                transport = TRANSPORT_RING;
+            else
+            {
+                fprintf(stderr, "Unknown transport %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 's':
+            slot_count = strtoul(optarg, NULL, 10);
+            break;
+        case 'w':
+            slot_words = strtoul(optarg, NULL, 10);
+            break;
+        case 'a':
+            arena_kib = strtoul(optarg, NULL, 10);
+            break;
+        case 'p':
+            use_pool = true;
+            pool_workers = strtoul(optarg, NULL, 10);
+            break;
+        case 'b':
+            spin = strtoul(optarg, NULL, 10);
+            break;
+        case 'c':
+            first_core = atoi(optarg);
+            break;
+        case 'P':
+            partitions = strtoul(optarg, NULL, 10);
+            break;
+        case 'S':
+            snapshot_path = optarg;
+            break;
+        case 'W':
+            wal_path = optarg;
+            break;
+        case 'I':
+            commit_us = strtoul(optarg, NULL, 10);
+            break;
+        case 'K':
+            commit_kib = strtoul(optarg, NULL, 10);
+            break;
+        case 'M':
+            budget_mib = strtoul(optarg, NULL, 10);
+            break;
+        case 'T':
+            ttl = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-e chain|swiss|shared] [-t slot|ring] [-s slots] [-w words per request] [-a arena KiB] [-p workers, 0 for one per core] [-b spins] [-c first core] [-P partitions] [-S snapshot file] [-W log file] [-I commit microseconds] [-K commit KiB] [-M budget MiB] [-T ttl seconds] [table size]\n", argv[0]);
+            return -1;
+        }
+    }
+    if (optind >= argc)
     {
         printf("No table size given defaulting to 100\n");
     }
     else
     {
-        table_size = strtoul(argv[1], NULL, 10);
+        table_size = strtoul(argv[optind], NULL, 10);
+    }
+    if (slot_count == 0 || slot_words < 2 || partitions == 0)
+    {
+        fprintf(stderr, "At least one slot with two words and one partition are needed\n");
+        return -1;
+    }
+    /*Every partition is served by a pool of its own*/
+    if (partitions > 1)
+        use_pool = true;
+    if (use_pool && pool_workers == 0)
+        pool_workers = sysconf(_SC_NPROCESSORS_ONLN) / partitions;
+    if (use_pool && pool_workers == 0)
+        pool_workers = 1;
+    /*Payloads consist of whole pages*/
+    slot_words = (slot_words * sizeof(uint32_t) + ARENA_PAGE - 1) / ARENA_PAGE * ARENA_PAGE / sizeof(uint32_t);
+    tables = malloc(sizeof(void *) * partitions);
+    for (uint32_t i = 0; i < partitions; i++)
+    {
+        tables[i] = engine->create(table_size / partitions > 0 ? table_size / partitions : 1);
+        if (tables[i] == NULL)
+            return -1;
     }
-    table = create_hashtable(table_size);
     int s = shm_open("shared-mem", O_RDWR | O_CREAT, 0777);
     shm_unlink("shared-mem");
     s = shm_open("shared-mem", O_RDWR | O_CREAT, 0777);
-    int size = (sizeof(exchange_t)) * CLIENT_SLOTS;
+    m_t layout;
+    size_t size = layout_memory_region(&layout);
 
     ftruncate(s, size);
     memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, s, 0);
@@ -294,32 +710,176 @@ int main(int argc, char **argv)
         return -1;
     }
     signal(SIGINT, stop_exec);
-    init_memory_region(memory, size);
+    /*Clients can connect while the tables are recovered, their requests wait for the workers*/
+    init_memory_region(memory, &layout);
+    /*The tables serve the keys of the snapshot right away and load them in the background*/
+    snapshot = snapshot_path != NULL ? snapshot_open(snapshot_path, route_key) : NULL;
+    if (snapshot != NULL)
+    {
+        fprintf(stderr, "Serving %lu entries of snapshot %s\n", snapshot_remaining(snapshot), snapshot_path);
+        overlays = malloc(sizeof(void *) * partitions);
+        for (uint32_t i = 0; i < partitions; i++)
+            tables[i] = overlays[i] = snapshot_overlay(snapshot, i, engine, tables[i]);
+        /*Clients read the shared table without the server, so it has to be complete.
+          A cache has to know every entry to keep the budget*/
+        bool load_now = memory->shared_table || budget_mib != 0 || ttl != 0;
+        engine = &snapshot_engine;
+        if (load_now)
+            snapshot_load(snapshot, overlays, &running);
+        log_sequence = snapshot_sequence(snapshot);
+    }
+    /*Changes after the snapshot are applied again from the log*/
+    if (wal_path != NULL)
+    {
+        uint64_t last;
+        int64_t replayed = wal_replay(wal_path, log_sequence, replay_record, NULL, &last);
+        if (replayed < 0)
+        {
+            fprintf(stderr, "Failed to read log %s\n", wal_path);
+            return -1;
+        }
+        fprintf(stderr, "Replayed %ld records of log %s\n", replayed, wal_path);
+        log_sequence = last > log_sequence ? last : log_sequence;
+    }
 
-    pthread_t t[CLIENT_SLOTS];
+    /*SIGUSR1 and SIGUSR2 are only handled by the signal thread, every thread started from here on blocks them*/
+    static sigset_t signal_set;
+    sigemptyset(&signal_set);
+    sigaddset(&signal_set, SIGUSR1);
+    sigaddset(&signal_set, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &signal_set, NULL);
+    if (wal_path != NULL)
+    {
+        wal = wal_open(wal_path, log_sequence, commit_us, commit_kib * 1024);
+        if (wal == NULL)
+        {
+            fprintf(stderr, "Failed to open log %s\n", wal_path);
+            return -1;
+        }
+        for (uint32_t i = 0; i < partitions; i++)
+        {
+            tables[i] = wal_wrap(wal, engine, tables[i]);
+            if (tables[i] == NULL)
+                return -1;
+        }
+        engine = &wal_engine;
+    }
+    /*The caches are above the log, so evictions and expiry are logged as deletes*/
+    if (budget_mib != 0 || ttl != 0)
+    {
+        cache_tables = malloc(sizeof(void *) * partitions);
+        for (uint32_t i = 0; i < partitions; i++)
+        {
+            cache_tables[i] = cache_wrap(engine, tables[i], (uint64_t)budget_mib * 1024 * 1024 / partitions, ttl);
+            if (cache_tables[i] == NULL)
+                return -1;
+            tables[i] = cache_tables[i];
+        }
+        engine = &cache_engine;
+    }
+    streams = calloc(memory->slot_count * memory->partitions, sizeof(stream_t));
+    if (streams == NULL)
+    {
+        fprintf(stderr, "Could not allocate the streams\n");
+        return -1;
+    }
+    /*The helpers use engine and tables, so they start once the tables are wrapped*/
+    pthread_t signal_thread;
+    pthread_create(&signal_thread, NULL, signal_function, &signal_set);
+    pthread_detach(signal_thread);
+    pthread_t load_thread;
+    if (snapshot != NULL)
+        pthread_create(&load_thread, NULL, load_function, NULL);
+    pthread_t sweep_thread;
+    if (cache_tables != NULL)
+        pthread_create(&sweep_thread, NULL, sweep_function, NULL);
+
+    uint32_t slots = memory->slot_count * memory->partitions;
+    int status = 0;
+    if (spin > 0)
+        ring_set_spin(spin);
+    if (use_pool)
+    {
+        /*stop_exec stops the pools created so far*/
+        pool_t **created = calloc(partitions, sizeof(pool_t *));
+        uint32_t count = 0;
+        pools = created;
+        for (; created != NULL && count < partitions; count++)
+        {
+            doorbell_t *d = get_doorbell(memory, count);
+            created[count] = pool_create(pool_workers, count * memory->slot_count, memory->slot_count,
+                                         transport == TRANSPORT_RING ? &ring_pool_ops : &slot_pool_ops, &d->ring, &d->sleepers,
+                                         spin, first_core >= 0 ? first_core + count * pool_workers : -1);
+            if (created[count] == NULL)
+                break;
+            /*A SIGINT before the pool was stored did not stop it*/
+            if (!running)
+                pool_stop(created[count]);
+        }
+        if (count < partitions)
+        {
+            fprintf(stderr, "Could not create the worker pools\n");
+            status = -1;
+            stop_exec(SIGINT);
+        }
+        for (uint32_t i = 0; i < count; i++)
+            pool_destroy(created[i]);
+        pools = NULL;
+        free(created);
+    }
+    else
+    {
+        /*One thread per slot of the header*/
+        pthread_t *t = malloc(sizeof(pthread_t) * memory->slot_count);
 
-    for (uint32_t i = 0; i < CLIENT_SLOTS; i++)
-        pthread_create(&t[i], NULL, serve_function, (void*)((uintptr_t)i));
+        for (uint32_t i = 0; i < memory->slot_count; i++)
+        {
+            pthread_create(&t[i], NULL, transport == TRANSPORT_RING ? serve_ring_function : serve_function, (void*)((uintptr_t)i));
+            if (first_core >= 0)
+                pin_thread(t[i], first_core + i);
+        }
 
-    for (uint32_t i = 0; i < CLIENT_SLOTS; i++)
-        pthread_join(t[i], NULL);
+        for (uint32_t i = 0; i < memory->slot_count; i++)
+            pthread_join(t[i], NULL);
+        free(t);
+    }
+    for (uint32_t i = 0; i < slots; i++)
+        free(streams[i].data);
+    free(streams);
 
-    for (int i = 0; i < CLIENT_SLOTS; i++)
+    for (uint32_t i = 0; i < slots; i++)
     {
-        pthread_mutex_destroy(&memory->c_slots[i].rw);
-        pthread_mutex_destroy(&memory->c_slots[i].cond_mutex);
-        pthread_cond_destroy(&memory->c_slots[i].cond);
+        pthread_mutex_destroy(&get_slot(memory, i)->rw);
+        pthread_mutex_destroy(&get_slot(memory, i)->cond_mutex);
+        pthread_cond_destroy(&get_slot(memory, i)->cond);
     }
 
     close(s);
     shm_unlink("shared-mem");
 
-    clear_hashtable(table);
-    free(table);
+    if (snapshot != NULL)
+        pthread_join(load_thread, NULL);
+    if (cache_tables != NULL)
+        pthread_join(sweep_thread, NULL);
+    if (snapshot_path != NULL)
+        write_snapshot();
+
+    /*A snapshot requested meanwhile would read the tables*/
+    pthread_mutex_lock(&snapshot_lock);
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < partitions; i++)
+        total += engine->destroy(tables[i]);
+    free(tables);
+    free(cache_tables);
+    free(overlays);
+    if (snapshot != NULL)
+        snapshot_close(snapshot);
+    if (wal != NULL)
+        wal_close(wal);
 #ifndef DONTPRINTEND
-    fprintf(stderr, "\nEntries left in table after after all clients finished: %d\n", total);
+    fprintf(stderr, "\nEntries left in table after after all clients finished: %lu\n", total);
 #else
     fprintf(stderr, "End of execution\n");
 #endif
-    return 0;
+    return status;
 }
\ No newline at end of file
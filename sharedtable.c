@@ -0,0 +1,438 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "table.h"
+#include "arena.h"
+#include "sharedtable.h"
+#ifdef USECUSTOMMALLOC
+#include "alloc.h"
+#endif
+
+/*
+Open addressing table with linear probing in a segment of its own, see sharedtable.h.
+Entries are never moved while the table is in use, a deleted entry is marked and
+reused by a later insert. Values that do not fit into the entry are stored in
+pages of an arena in the segment. Once a quarter of the entries is deleted, the
+server compacts the table, readers wait for that through the sequence number
+of the table.
+*/
+
+/*Size of the value pages of one table, the segment is only backed where it is used*/
+#ifndef SHARED_TABLE_MIB
+#define SHARED_TABLE_MIB 64
+#endif
+#define SHARED_MIN_CAPACITY (1 << 16)
+/*At most 7/8 of the entries are used or deleted*/
+#define MAX_LOAD_NUM 7
+#define MAX_LOAD_DEN 8
+#define COMPACT_DEN 4
+
+#define ENTRY_EMPTY 0
+#define ENTRY_USED 1
+#define ENTRY_DELETED 2
+/*Values up to this size are stored in the entry, so an entry fills a cache line*/
+#define SHARED_INLINE_SIZE 44
+
+typedef struct shared_entry
+{
+    _Atomic uint32_t seq;
+    uint32_t state;
+    uint32_t key;
+    uint32_t length;
+    /*First page of the value if it is not stored in the entry*/
+    uint32_t page;
+    uint8_t data[SHARED_INLINE_SIZE];
+} shared_entry_t;
+
+struct shared_table_header
+{
+    uint32_t magic;
+    uint32_t version;
+    /*Number of entries, a power of two*/
+    uint32_t capacity;
+    uint32_t page_count;
+    uint64_t entries_offset;
+    uint64_t arena_offset;
+    uint64_t pages_offset;
+    uint64_t total_size;
+    /*Odd while the table is compacted*/
+    _Atomic uint32_t seq;
+};
+
+/*State only the server needs, it is not in the segment*/
+typedef struct shared_table
+{
+    shared_table_header_t *h;
+    /*Writers are serialized, readers do not take it*/
+    pthread_mutex_t lock;
+    char name[32];
+    uint32_t count;
+    uint32_t tombstones;
+    uint32_t compactions;
+    uint32_t rejected;
+} shared_table_t;
+
+/*Smaller than INLINE_VALUE_SIZE, so an entry fills a cache line*/
+static inline bool in_entry(uint32_t length)
+{
+    return length <= SHARED_INLINE_SIZE;
+}
+
+static inline shared_entry_t *get_entries(const shared_table_header_t *h)
+{
+    return (shared_entry_t *)((char *)h + h->entries_offset);
+}
+
+static inline arena_t *get_value_arena(shared_table_header_t *h)
+{
+    return (arena_t *)((char *)h + h->arena_offset);
+}
+
+/*Returns NULL if the pages of a value of length bytes from page on are not in the segment,
+  which a reader only sees in an entry that is changed meanwhile*/
+static inline uint8_t *page_address(const shared_table_header_t *h, uint32_t page, uint32_t length)
+{
+    if (page >= h->page_count || (uint64_t)page * ARENA_PAGE + length > (uint64_t)h->page_count * ARENA_PAGE)
+        return NULL;
+    return (uint8_t *)h + h->pages_offset + (uint64_t)page * ARENA_PAGE;
+}
+
+/*Reads entry e without locking it. Sets *state and, if the entry holds key, copies its value.
+  Returns false if the server changed the entry meanwhile and it has to be read again*/
+static bool read_entry(const shared_table_header_t *h, const shared_entry_t *e, uint32_t key, uint32_t offset,
+                       void *dest, uint32_t capacity, uint32_t *state, int64_t *length)
+{
+    uint32_t seq = atomic_load_explicit(&e->seq, memory_order_acquire);
+    if (seq & 1)
+        return false;
+    *state = __atomic_load_n(&e->state, __ATOMIC_RELAXED);
+    if (*state == ENTRY_USED && __atomic_load_n(&e->key, __ATOMIC_RELAXED) == key)
+    {
+        uint32_t l = __atomic_load_n(&e->length, __ATOMIC_RELAXED);
+        const uint8_t *value = in_entry(l) ? e->data : page_address(h, __atomic_load_n(&e->page, __ATOMIC_RELAXED), l);
+        if (value == NULL)
+            return false;
+        *length = l;
+        /*A torn copy is detected by the check of seq below*/
+        copy_range(dest, value, l, offset, capacity);
+    }
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&e->seq, memory_order_relaxed) == seq;
+}
+
+int64_t shared_table_read(const shared_table_header_t *h, uint32_t key, uint32_t offset, void *dest, uint32_t capacity)
+{
+    const shared_entry_t *entries = get_entries(h);
+    uint32_t mask = h->capacity - 1;
+    uint64_t hash = hash_key(key);
+    for (;;)
+    {
+        uint32_t table_seq = atomic_load_explicit(&h->seq, memory_order_acquire);
+        if (table_seq & 1)
+            continue;
+        int64_t length = -1;
+        for (uint32_t i = 0; i <= mask; i++)
+        {
+            const shared_entry_t *e = &entries[(hash + i) & mask];
+            uint32_t state;
+            length = -1;
+            while (!read_entry(h, e, key, offset, dest, capacity, &state, &length))
+                ;
+            if (state == ENTRY_EMPTY || length >= 0)
+                break;
+        }
+        /*Entries are only moved by a compaction*/
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&h->seq, memory_order_relaxed) == table_seq)
+            return length;
+    }
+}
+
+shared_table_header_t *shared_table_map(uint32_t partition)
+{
+    char name[32];
+    snprintf(name, sizeof(name), SHARED_TABLE_NAME, partition);
+    int s = shm_open(name, O_RDONLY, 0);
+    if (s < 0)
+        return NULL;
+    shared_table_header_t *h = mmap(NULL, sizeof(shared_table_header_t), PROT_READ, MAP_SHARED, s, 0);
+    if (h == MAP_FAILED || h->magic != SHARED_TABLE_MAGIC || h->version != SHARED_TABLE_VERSION)
+    {
+        if (h != MAP_FAILED)
+            munmap(h, sizeof(shared_table_header_t));
+        close(s);
+        return NULL;
+    }
+    size_t size = h->total_size;
+    munmap(h, sizeof(shared_table_header_t));
+    h = mmap(NULL, size, PROT_READ, MAP_SHARED, s, 0);
+    close(s);
+    return h == MAP_FAILED ? NULL : h;
+}
+
+void shared_table_unmap(shared_table_header_t *h)
+{
+    munmap(h, h->total_size);
+}
+
+void *shared_create(uint32_t size)
+{
+    /*The server creates the table of partition i as the i-th table*/
+    static _Atomic uint32_t next_partition = 0;
+    uint32_t capacity = SHARED_MIN_CAPACITY;
+    while (capacity < (uint64_t)size * 2)
+        capacity *= 2;
+    uint32_t page_count = (uint64_t)SHARED_TABLE_MIB * 1024 * 1024 / ARENA_PAGE;
+
+    shared_table_header_t layout = {.magic = SHARED_TABLE_MAGIC, .version = SHARED_TABLE_VERSION,
+                                    .capacity = capacity, .page_count = page_count};
+    layout.entries_offset = (sizeof(shared_table_header_t) + 63) & ~(uint64_t)63;
+    layout.arena_offset = layout.entries_offset + (uint64_t)capacity * sizeof(shared_entry_t);
+    layout.pages_offset = (layout.arena_offset + arena_size(page_count) + 63) & ~(uint64_t)63;
+    layout.total_size = layout.pages_offset + (uint64_t)page_count * ARENA_PAGE;
+
+    shared_table_t *t = calloc(1, sizeof(shared_table_t));
+    snprintf(t->name, sizeof(t->name), SHARED_TABLE_NAME, atomic_fetch_add(&next_partition, 1));
+    /*A segment left by an earlier server is replaced*/
+    shm_unlink(t->name);
+    int s = shm_open(t->name, O_RDWR | O_CREAT, 0777);
+    if (s < 0 || ftruncate(s, layout.total_size) != 0)
+    {
+        fprintf(stderr, "Failed to create %s\n", t->name);
+        free(t);
+        return NULL;
+    }
+    t->h = mmap(NULL, layout.total_size, PROT_READ | PROT_WRITE, MAP_SHARED, s, 0);
+    close(s);
+    if (t->h == MAP_FAILED)
+    {
+        fprintf(stderr, "Failed to map %s\n", t->name);
+        shm_unlink(t->name);
+        free(t);
+        return NULL;
+    }
+    /*The entries of a new segment are zero, so they are empty*/
+    *t->h = layout;
+    arena_init(get_value_arena(t->h), page_count);
+    pthread_mutex_init(&t->lock, NULL);
+    return t;
+}
+
+/*Copies a separate value into pages that are not reachable yet, sets *page to ARENA_NONE for an inline value.
+  Returns false if there are no free pages for it*/
+static bool store_value(shared_table_t *t, const void *data, uint32_t data_length, uint32_t *page)
+{
+    *page = ARENA_NONE;
+    if (in_entry(data_length))
+        return true;
+    uint32_t pages = (data_length + ARENA_PAGE - 1) / ARENA_PAGE, got;
+    uint32_t first = arena_alloc(get_value_arena(t->h), pages, &got);
+    if (got < pages)
+    {
+        if (first != ARENA_NONE)
+            arena_free(get_value_arena(t->h), first, got);
+        return false;
+    }
+    memcpy(page_address(t->h, first, data_length), data, data_length);
+    *page = first;
+    return true;
+}
+
+/*Only called once no reader can reach the value through an entry any more*/
+static void release_value(shared_table_t *t, uint32_t page, uint32_t length)
+{
+    if (!in_entry(length))
+        arena_free(get_value_arena(t->h), page, (length + ARENA_PAGE - 1) / ARENA_PAGE);
+}
+
+static void fill_entry(shared_entry_t *e, uint32_t key, const void *data, uint32_t data_length, uint32_t page)
+{
+    begin_write(&e->seq);
+    e->key = key;
+    e->length = data_length;
+    e->page = page;
+    if (in_entry(data_length))
+        memcpy(e->data, data, data_length);
+    e->state = ENTRY_USED;
+    end_write(&e->seq);
+}
+
+/*Returns the first entry of key in its probe sequence, the one readers find, or NULL*/
+static shared_entry_t *find_entry(shared_table_t *t, uint32_t key)
+{
+    shared_entry_t *entries = get_entries(t->h);
+    uint32_t mask = t->h->capacity - 1;
+    uint64_t hash = hash_key(key);
+    for (uint32_t i = 0; i <= mask; i++)
+    {
+        shared_entry_t *e = &entries[(hash + i) & mask];
+        if (e->state == ENTRY_USED && e->key == key)
+            return e;
+        if (e->state == ENTRY_EMPTY)
+            break;
+    }
+    return NULL;
+}
+
+/*Returns the first entry in the probe sequence of key that holds no value or NULL*/
+static shared_entry_t *find_free_entry(shared_table_t *t, uint32_t key)
+{
+    shared_entry_t *entries = get_entries(t->h);
+    uint32_t mask = t->h->capacity - 1;
+    uint64_t hash = hash_key(key);
+    for (uint32_t i = 0; i <= mask; i++)
+    {
+        shared_entry_t *e = &entries[(hash + i) & mask];
+        if (e->state != ENTRY_USED)
+            return e;
+    }
+    return NULL;
+}
+
+/*Puts the used entries back without deleted ones in between, readers wait meanwhile*/
+static void compact(shared_table_t *t)
+{
+    shared_entry_t *entries = get_entries(t->h);
+    uint32_t capacity = t->h->capacity;
+    shared_entry_t *old = malloc(sizeof(shared_entry_t) * capacity);
+    /*The tombstones stay until a later insert can compact the table*/
+    if (old == NULL)
+    {
+        fprintf(stderr, "Could not compact shared table %s\n", t->name);
+        return;
+    }
+    begin_write(&t->h->seq);
+    memcpy(old, entries, sizeof(shared_entry_t) * capacity);
+    for (uint32_t i = 0; i < capacity; i++)
+        entries[i].state = ENTRY_EMPTY;
+    for (uint32_t i = 0; i < capacity; i++)
+    {
+        if (old[i].state != ENTRY_USED)
+            continue;
+        fill_entry(find_free_entry(t, old[i].key), old[i].key, old[i].data, old[i].length, old[i].page);
+    }
+    end_write(&t->h->seq);
+    free(old);
+    t->tombstones = 0;
+    t->compactions++;
+}
+
+bool shared_insert(void *table, uint32_t key, const void *data, uint32_t data_length)
+{
+    shared_table_t *t = table;
+    pthread_mutex_lock(&t->lock);
+    uint32_t page;
+    uint64_t max_entries = (uint64_t)t->h->capacity * MAX_LOAD_NUM / MAX_LOAD_DEN;
+    if (t->count + t->tombstones >= max_entries && t->tombstones > 0)
+        compact(t);
+    /*Like the other engines a key gets another entry, which takes the first free one*/
+    shared_entry_t *e = find_free_entry(t, key);
+    if (t->count + t->tombstones >= max_entries || e == NULL || !store_value(t, data, data_length, &page))
+    {
+        if (t->rejected++ == 0)
+            fprintf(stderr, "Shared table %s is full\n", t->name);
+        pthread_mutex_unlock(&t->lock);
+        return false;
+    }
+    if (e->state == ENTRY_DELETED)
+        t->tombstones--;
+    fill_entry(e, key, data, data_length, page);
+    t->count++;
+    pthread_mutex_unlock(&t->lock);
+    return true;
+}
+
+bool shared_insert_owned(void *table, uint32_t key, void *data, uint32_t data_length)
+{
+    bool inserted = shared_insert(table, key, data, data_length);
+    free(data);
+    return inserted;
+}
+
+int64_t shared_read(void *table, uint32_t key, uint32_t offset, void *dest, uint32_t capacity)
+{
+    shared_table_t *t = table;
+    return shared_table_read(t->h, key, offset, dest, capacity);
+}
+
+bool shared_delete(void *table, uint32_t key)
+{
+    shared_table_t *t = table;
+    pthread_mutex_lock(&t->lock);
+    shared_entry_t *e = find_entry(t, key);
+    if (e == NULL)
+    {
+        pthread_mutex_unlock(&t->lock);
+        return false;
+    }
+    begin_write(&e->seq);
+    e->state = ENTRY_DELETED;
+    end_write(&e->seq);
+    release_value(t, e->page, e->length);
+    t->count--;
+    t->tombstones++;
+    if (t->tombstones > t->h->capacity / COMPACT_DEN)
+        compact(t);
+    pthread_mutex_unlock(&t->lock);
+    return true;
+}
+
+uint64_t shared_destroy(void *table)
+{
+    shared_table_t *t = table;
+    uint64_t count = t->count;
+    munmap(t->h, t->h->total_size);
+    shm_unlink(t->name);
+    pthread_mutex_destroy(&t->lock);
+    free(t);
+    return count;
+}
+
+void shared_for_each(void *table, table_visit_t visit, void *ctx)
+{
+    shared_table_t *t = table;
+    pthread_mutex_lock(&t->lock);
+    shared_entry_t *entries = get_entries(t->h);
+    for (uint32_t i = 0; i < t->h->capacity; i++)
+    {
+        shared_entry_t *e = &entries[i];
+        if (e->state == ENTRY_USED)
+            visit(ctx, e->key, in_entry(e->length) ? e->data : page_address(t->h, e->page, e->length), e->length);
+    }
+    pthread_mutex_unlock(&t->lock);
+}
+
+void shared_print_stats(void *table, FILE *f)
+{
+    shared_table_t *t = table;
+    pthread_mutex_lock(&t->lock);
+    arena_t *a = get_value_arena(t->h);
+    fprintf(f, "Segment:              %s\n", t->name);
+    fprintf(f, "Slots:                %u\n", t->h->capacity);
+    fprintf(f, "Entries:              %u\n", t->count);
+    fprintf(f, "Deleted slots:        %u\n", t->tombstones);
+    fprintf(f, "Load factor:          %.3f\n", (double)t->count / t->h->capacity);
+    fprintf(f, "Compactions:          %u\n", t->compactions);
+    fprintf(f, "Free value pages:     %u of %u\n", a->free_pages, a->page_count);
+    fprintf(f, "Rejected inserts:     %u\n", t->rejected);
+    pthread_mutex_unlock(&t->lock);
+}
+
+const table_engine_t shared_engine = {
+    .name = "shared",
+    .create = shared_create,
+    .insert = shared_insert,
+    .insert_owned = shared_insert_owned,
+    .read = shared_read,
+    .delete = shared_delete,
+    .destroy = shared_destroy,
+    .for_each = shared_for_each,
+    .print_stats = shared_print_stats,
+};
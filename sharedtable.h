@@ -0,0 +1,32 @@
+#ifndef SHAREDTABLE_H
+#define SHAREDTABLE_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+/*
+Table in a shared memory segment of its own, which the clients map read only.
+The entries refer to their values by page numbers instead of pointers, so a
+client looks keys up at any address without asking the server. Only the
+server changes the table, every entry has a sequence number which the server
+makes odd while it changes the entry, a reader retries if it was odd or
+changed during the lookup. The table itself has such a number for compactions.
+*/
+
+#define SHARED_TABLE_MAGIC 0x6b767374
+#define SHARED_TABLE_VERSION 1
+/*Segment of the table of a partition*/
+#define SHARED_TABLE_NAME "shared-table-%u"
+
+typedef struct shared_table_header shared_table_header_t;
+
+/*Maps the table of partition read only, returns NULL if there is none*/
+shared_table_header_t *shared_table_map(uint32_t partition);
+
+void shared_table_unmap(shared_table_header_t *h);
+
+/*Copies the value of key from offset on into dest, which holds capacity bytes.
+  Returns the length of the whole value or -1 if key is not in the table*/
+int64_t shared_table_read(const shared_table_header_t *h, uint32_t key, uint32_t offset, void *dest, uint32_t capacity);
+
+#endif
@@ -0,0 +1,419 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "snapshot.h"
+#ifdef USECUSTOMMALLOC
+#include "alloc.h"
+#endif
+
+#define SNAPSHOT_MAGIC 0x6b767370
+#define SNAPSHOT_VERSION 2
+/*The entries of a key are loaded once, under one of these locks*/
+#define SNAPSHOT_LOCKS 256
+#define MIN_INDEX_CAPACITY 16
+
+typedef struct snapshot_header
+{
+    uint32_t magic;
+    uint32_t version;
+    /*Number of entries, each has a slot in the index*/
+    uint64_t count;
+    uint64_t index_offset;
+    /*Slots of the index, a power of two*/
+    uint64_t index_capacity;
+    uint64_t size;
+    /*Number of the last log record contained in the snapshot*/
+    uint64_t sequence;
+} snapshot_header_t;
+
+/*Entries follow the header, each padded to 8 bytes*/
+typedef struct snapshot_record
+{
+    uint32_t key;
+    uint32_t length;
+    uint8_t data[];
+} snapshot_record_t;
+
+/*Open addressing index of the entries, offset is 0 for an empty slot. The entries
+  of a key follow each other in its probe sequence in the order they were written*/
+typedef struct snapshot_slot
+{
+    uint64_t offset;
+    uint32_t key;
+    uint32_t length;
+} snapshot_slot_t;
+
+#define RECORD_SIZE(length) ((sizeof(snapshot_record_t) + (uint64_t)(length) + 7) & ~(uint64_t)7)
+
+struct snapshot
+{
+    uint8_t *base;
+    snapshot_header_t *h;
+    snapshot_slot_t *index;
+    snapshot_route_t route;
+    /*Set for a slot of the index once its entry was inserted into the table,
+      all entries of a key are inserted together*/
+    _Atomic uint8_t *loaded;
+    _Atomic uint64_t remaining;
+    pthread_mutex_t locks[SNAPSHOT_LOCKS];
+};
+
+typedef struct overlay
+{
+    snapshot_t *s;
+    uint32_t partition;
+    const table_engine_t *base;
+    void *table;
+} overlay_t;
+
+typedef struct snapshot_writer
+{
+    FILE *f;
+    uint64_t offset;
+    /*Every entry written, the index is built from them at the end*/
+    snapshot_slot_t *entries;
+    uint64_t count;
+    uint64_t allocated;
+    bool failed;
+} snapshot_writer_t;
+
+static void write_entry(void *ctx, uint32_t key, const void *value, uint32_t length)
+{
+    static const uint8_t padding[8];
+    snapshot_writer_t *w = ctx;
+    if (w->failed)
+        return;
+    if (w->count == w->allocated)
+    {
+        uint64_t allocated = w->allocated ? w->allocated * 2 : 1024;
+        snapshot_slot_t *entries = realloc(w->entries, allocated * sizeof(snapshot_slot_t));
+        if (entries == NULL)
+        {
+            w->failed = true;
+            return;
+        }
+        w->entries = entries;
+        w->allocated = allocated;
+    }
+    snapshot_record_t r = {.key = key, .length = length};
+    uint64_t size = RECORD_SIZE(length);
+    if (fwrite(&r, sizeof(r), 1, w->f) != 1 || (length > 0 && fwrite(value, length, 1, w->f) != 1) ||
+        (size > sizeof(r) + length && fwrite(padding, size - sizeof(r) - length, 1, w->f) != 1))
+    {
+        w->failed = true;
+        return;
+    }
+    w->entries[w->count++] = (snapshot_slot_t){.offset = w->offset, .key = key, .length = length};
+    w->offset += size;
+}
+
+/*Builds the index of the written entries. They are added in the order of the file,
+  so a later entry of a key comes after the earlier ones in its probe sequence*/
+static snapshot_slot_t *build_index(snapshot_writer_t *w, uint64_t *capacity)
+{
+    *capacity = MIN_INDEX_CAPACITY;
+    while (*capacity < w->count * 2)
+        *capacity *= 2;
+    snapshot_slot_t *index = calloc(*capacity, sizeof(snapshot_slot_t));
+    if (index == NULL)
+        return NULL;
+    for (uint64_t n = 0; n < w->count; n++)
+    {
+        uint64_t i = hash_key(w->entries[n].key) & (*capacity - 1);
+        while (index[i].offset != 0)
+            i = (i + 1) & (*capacity - 1);
+        index[i] = w->entries[n];
+    }
+    return index;
+}
+
+/*Makes a rename in the directory of path durable*/
+static bool sync_directory(const char *path)
+{
+    char dir[4096];
+    snprintf(dir, sizeof(dir), "%s", path);
+    char *slash = strrchr(dir, '/');
+    if (slash == NULL)
+        snprintf(dir, sizeof(dir), ".");
+    else if (slash == dir)
+        slash[1] = '\0';
+    else
+        *slash = '\0';
+    int fd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (fd < 0)
+        return false;
+    bool ok = fsync(fd) == 0;
+    close(fd);
+    return ok;
+}
+
+int64_t snapshot_write(const table_engine_t *engine, void **tables, uint32_t count, const char *path, uint64_t sequence)
+{
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *f = fopen(tmp, "w");
+    if (f == NULL)
+        return -1;
+    snapshot_header_t h = {.magic = SNAPSHOT_MAGIC, .version = SNAPSHOT_VERSION, .sequence = sequence};
+    snapshot_writer_t w = {.f = f, .offset = sizeof(h)};
+    /*The header is written again once the index is known*/
+    w.failed = fwrite(&h, sizeof(h), 1, f) != 1;
+    for (uint32_t i = 0; i < count; i++)
+        engine->for_each(tables[i], write_entry, &w);
+
+    snapshot_slot_t *index = NULL;
+    if (!w.failed)
+        index = build_index(&w, &h.index_capacity);
+    h.count = w.count;
+    h.index_offset = w.offset;
+    h.size = h.index_offset + h.index_capacity * sizeof(snapshot_slot_t);
+    bool ok = index != NULL && fwrite(index, sizeof(snapshot_slot_t), h.index_capacity, f) == h.index_capacity &&
+              fseek(f, 0, SEEK_SET) == 0 && fwrite(&h, sizeof(h), 1, f) == 1 && fflush(f) == 0 && fsync(fileno(f)) == 0;
+    ok &= fclose(f) == 0;
+    free(index);
+    free(w.entries);
+    /*The old snapshot is only replaced by a complete one*/
+    if (!ok || rename(tmp, path) != 0)
+    {
+        unlink(tmp);
+        return -1;
+    }
+    /*Until the directory is synced a crash may bring back the old snapshot,
+      so the log must not be truncated before*/
+    if (!sync_directory(path))
+        return -1;
+    return h.count;
+}
+
+snapshot_t *snapshot_open(const char *path, snapshot_route_t route)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (uint64_t)st.st_size < sizeof(snapshot_header_t))
+    {
+        close(fd);
+        return NULL;
+    }
+    uint8_t *base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+        return NULL;
+    snapshot_header_t *h = (snapshot_header_t *)base;
+    uint64_t capacity = h->index_capacity;
+    if (h->magic != SNAPSHOT_MAGIC || h->version != SNAPSHOT_VERSION || h->size != (uint64_t)st.st_size ||
+        capacity == 0 || (capacity & (capacity - 1)) != 0 || h->count >= capacity || h->index_offset < sizeof(snapshot_header_t) ||
+        h->index_offset > h->size || (h->size - h->index_offset) / sizeof(snapshot_slot_t) != capacity)
+    {
+        fprintf(stderr, "Snapshot %s is damaged\n", path);
+        munmap(base, st.st_size);
+        return NULL;
+    }
+    snapshot_t *s = calloc(1, sizeof(snapshot_t));
+    s->base = base;
+    s->h = h;
+    s->index = (snapshot_slot_t *)(base + h->index_offset);
+    s->route = route;
+    /*Zeroed pages are only backed once they are written*/
+    s->loaded = calloc(capacity, sizeof(_Atomic uint8_t));
+    s->remaining = h->count;
+    for (int i = 0; i < SNAPSHOT_LOCKS; i++)
+        pthread_mutex_init(&s->locks[i], NULL);
+    return s;
+}
+
+uint64_t snapshot_sequence(snapshot_t *s)
+{
+    return s->h->sequence;
+}
+
+uint64_t snapshot_remaining(snapshot_t *s)
+{
+    return atomic_load(&s->remaining);
+}
+
+/*Returns the value of slot i, NULL if it does not lie within the entries*/
+static const uint8_t *slot_value(snapshot_t *s, uint64_t i)
+{
+    snapshot_slot_t *slot = &s->index[i];
+    if (slot->offset < sizeof(snapshot_header_t) || slot->offset > s->h->index_offset ||
+        RECORD_SIZE(slot->length) > s->h->index_offset - slot->offset)
+        return NULL;
+    snapshot_record_t *r = (snapshot_record_t *)(s->base + slot->offset);
+    return r->key == slot->key && r->length == slot->length ? r->data : NULL;
+}
+
+/*Returns the slot of the first entry of key in the index, -1 if key is not in the snapshot*/
+static int64_t find_slot(snapshot_t *s, uint32_t key)
+{
+    uint64_t mask = s->h->index_capacity - 1;
+    uint64_t i = hash_key(key) & mask;
+    for (uint64_t n = 0; n <= mask && s->index[i].offset != 0; n++, i = (i + 1) & mask)
+    {
+        if (s->index[i].key == key)
+            return i;
+    }
+    return -1;
+}
+
+/*Returns the slot of the first entry of key if its entries are not loaded yet, -1 otherwise*/
+static int64_t pending_slot(snapshot_t *s, uint32_t key)
+{
+    if (atomic_load(&s->remaining) == 0)
+        return -1;
+    int64_t i = find_slot(s, key);
+    return i >= 0 && !atomic_load_explicit(&s->loaded[i], memory_order_acquire) ? i : -1;
+}
+
+/*Marks slot i as loaded, its lock has to be held*/
+static void settle(snapshot_t *s, uint64_t i)
+{
+    if (atomic_load_explicit(&s->loaded[i], memory_order_relaxed))
+        return;
+    atomic_store_explicit(&s->loaded[i], 1, memory_order_release);
+    atomic_fetch_sub(&s->remaining, 1);
+}
+
+void *snapshot_overlay(snapshot_t *s, uint32_t partition, const table_engine_t *base, void *table)
+{
+    overlay_t *o = malloc(sizeof(overlay_t));
+    *o = (overlay_t){.s = s, .partition = partition, .base = base, .table = table};
+    return o;
+}
+
+/*Before a key of the snapshot is changed, its entries are loaded in the order they
+  were written, so the change applies to the table as if the whole snapshot had
+  been loaded before*/
+static void load_pending(overlay_t *o, uint32_t key)
+{
+    snapshot_t *s = o->s;
+    if (pending_slot(s, key) < 0)
+        return;
+    pthread_mutex_t *lock = &s->locks[hash_key(key) % SNAPSHOT_LOCKS];
+    pthread_mutex_lock(lock);
+    uint64_t mask = s->h->index_capacity - 1;
+    uint64_t i = hash_key(key) & mask;
+    for (uint64_t n = 0; n <= mask && s->index[i].offset != 0; n++, i = (i + 1) & mask)
+    {
+        if (s->index[i].key != key || atomic_load(&s->loaded[i]))
+            continue;
+        const uint8_t *value = slot_value(s, i);
+        if (value != NULL)
+            o->base->insert(o->table, key, value, s->index[i].length);
+        settle(s, i);
+    }
+    pthread_mutex_unlock(lock);
+}
+
+static bool overlay_insert(void *table, uint32_t key, const void *data, uint32_t data_length)
+{
+    overlay_t *o = table;
+    load_pending(o, key);
+    return o->base->insert(o->table, key, data, data_length);
+}
+
+static bool overlay_insert_owned(void *table, uint32_t key, void *data, uint32_t data_length)
+{
+    overlay_t *o = table;
+    load_pending(o, key);
+    return o->base->insert_owned(o->table, key, data, data_length);
+}
+
+static int64_t overlay_read(void *table, uint32_t key, uint32_t offset, void *dest, uint32_t capacity)
+{
+    overlay_t *o = table;
+    int64_t i = pending_slot(o->s, key);
+    const uint8_t *value = i >= 0 ? slot_value(o->s, i) : NULL;
+    if (value == NULL)
+        return o->base->read(o->table, key, offset, dest, capacity);
+    uint32_t length = o->s->index[i].length;
+    copy_range(dest, value, length, offset, capacity);
+    return length;
+}
+
+static bool overlay_delete(void *table, uint32_t key)
+{
+    overlay_t *o = table;
+    load_pending(o, key);
+    return o->base->delete(o->table, key);
+}
+
+/*The entries of the partition that are not loaded yet are loaded first,
+  so every entry is visited once, in the table*/
+static void overlay_for_each(void *table, table_visit_t visit, void *ctx)
+{
+    overlay_t *o = table;
+    snapshot_t *s = o->s;
+    for (uint64_t i = 0; i < s->h->index_capacity && atomic_load(&s->remaining) > 0; i++)
+    {
+        if (s->index[i].offset != 0 && !atomic_load_explicit(&s->loaded[i], memory_order_acquire) &&
+            s->route(s->index[i].key) == o->partition)
+            load_pending(o, s->index[i].key);
+    }
+    o->base->for_each(o->table, visit, ctx);
+}
+
+static uint64_t overlay_destroy(void *table)
+{
+    overlay_t *o = table;
+    snapshot_t *s = o->s;
+    uint64_t count = o->base->destroy(o->table);
+    for (uint64_t i = 0; i < s->h->index_capacity && atomic_load(&s->remaining) > 0; i++)
+    {
+        if (s->index[i].offset != 0 && !s->loaded[i] && s->route(s->index[i].key) == o->partition)
+            count++;
+    }
+    free(o);
+    return count;
+}
+
+static void overlay_print_stats(void *table, FILE *f)
+{
+    overlay_t *o = table;
+    o->base->print_stats(o->table, f);
+    fprintf(f, "Snapshot not loaded:  %lu of %lu\n", snapshot_remaining(o->s), o->s->h->count);
+}
+
+/*The entries are read in the order of the file, the first entry of a key
+  loads all of them, the later ones are loaded already*/
+void snapshot_load(snapshot_t *s, void **overlays, volatile int *running)
+{
+    uint64_t offset = sizeof(snapshot_header_t);
+    while (offset + sizeof(snapshot_record_t) <= s->h->index_offset && *running && atomic_load(&s->remaining) > 0)
+    {
+        snapshot_record_t *r = (snapshot_record_t *)(s->base + offset);
+        load_pending(overlays[s->route(r->key)], r->key);
+        offset += RECORD_SIZE(r->length);
+    }
+}
+
+void snapshot_close(snapshot_t *s)
+{
+    munmap(s->base, s->h->size);
+    for (int i = 0; i < SNAPSHOT_LOCKS; i++)
+        pthread_mutex_destroy(&s->locks[i]);
+    free((void *)s->loaded);
+    free(s);
+}
+
+/*Tables of this engine are only made by snapshot_overlay*/
+const table_engine_t snapshot_engine = {
+    .name = "snapshot",
+    .create = NULL,
+    .insert = overlay_insert,
+    .insert_owned = overlay_insert_owned,
+    .read = overlay_read,
+    .delete = overlay_delete,
+    .destroy = overlay_destroy,
+    .for_each = overlay_for_each,
+    .print_stats = overlay_print_stats,
+};
@@ -0,0 +1,48 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "table.h"
+
+/*
+Snapshot of the tables in a file. The entries are written one after the other,
+followed by an index of them, so a snapshot is written sequentially and can be
+used right after it was mapped. Until the entries of a key were loaded into its
+table, reads of the key are served from the mapped file.
+*/
+
+typedef struct snapshot snapshot_t;
+
+/*Returns the partition of a key*/
+typedef uint32_t (*snapshot_route_t)(uint32_t key);
+
+/*Writes the entries of count tables to a temporary file which then replaces path.
+  sequence is the number of the last log record in the tables, see wal.h.
+  Returns the number of entries written or -1 if the snapshot is not durable*/
+int64_t snapshot_write(const table_engine_t *engine, void **tables, uint32_t count, const char *path, uint64_t sequence);
+
+/*Maps the snapshot at path, NULL if there is none or it is damaged*/
+snapshot_t *snapshot_open(const char *path, snapshot_route_t route);
+
+/*Number of the last log record contained in the snapshot*/
+uint64_t snapshot_sequence(snapshot_t *s);
+
+/*Number of entries of the snapshot that are not loaded yet*/
+uint64_t snapshot_remaining(snapshot_t *s);
+
+/*Wraps table, which belongs to partition and uses base, in a table of snapshot_engine
+  that serves the keys of the snapshot until they are loaded*/
+void *snapshot_overlay(snapshot_t *s, uint32_t partition, const table_engine_t *base, void *table);
+
+/*Serves a table of another engine together with the entries of a snapshot*/
+extern const table_engine_t snapshot_engine;
+
+/*Inserts the entries of the snapshot into the overlays of their partitions,
+  returns once all are loaded or *running is 0*/
+void snapshot_load(snapshot_t *s, void **overlays, volatile int *running);
+
+/*Unmaps the snapshot, the overlays have to be destroyed first*/
+void snapshot_close(snapshot_t *s);
+
+#endif
@@ -0,0 +1,401 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "table.h"
+#ifdef USECUSTOMMALLOC
+#include "alloc.h"
+#endif
+
+/*
+Open addressing hash table in the style of a swiss table.
+Every slot has a control byte, which is either empty, deleted or
+holds 7 bits of the hash of its key. Control bytes are probed in groups
+of 16 with SIMD, so a lookup only looks at keys whose hash bits match.
+The table is split into segments by the upper hash bits.
+Each segment has its own lock and grows on its own, so a resize only
+blocks the keys of one segment.
+*/
+
+#define SEGMENT_BITS 6
+#define SEGMENTS (1 << SEGMENT_BITS)
+#define GROUP_SIZE 16
+#define MIN_CAPACITY GROUP_SIZE
+#define CTRL_EMPTY ((int8_t)0x80)
+#define CTRL_DELETED ((int8_t)0xFE)
+/*Segments grow when 7/8 of their slots are full or deleted*/
+#define MAX_LOAD_NUM 7
+#define MAX_LOAD_DEN 8
+
+/*Values up to INLINE_VALUE_SIZE bytes are stored in the slot*/
+typedef struct swiss_slot
+{
+    uint32_t key;
+    uint32_t length;
+    union
+    {
+        void *obj;
+        uint8_t data[INLINE_VALUE_SIZE];
+    };
+} swiss_slot_t;
+
+static inline void *slot_value(swiss_slot_t *slot)
+{
+    return is_inline(slot->length) ? slot->data : slot->obj;
+}
+
+typedef struct swiss_segment
+{
+    pthread_rwlock_t lock;
+    uint32_t capacity;
+    uint32_t size;
+    uint32_t tombstones;
+    uint32_t resizes;
+    int8_t *ctrl;
+    swiss_slot_t *slots;
+} __attribute__((aligned(64))) swiss_segment_t;
+
+typedef struct swisstable
+{
+    swiss_segment_t segments[SEGMENTS];
+} swisstable_t;
+
+static inline uint32_t segment_of(uint64_t hash)
+{
+    return hash >> (64 - SEGMENT_BITS);
+}
+
+static inline int8_t h2(uint64_t hash)
+{
+    return (hash >> (64 - SEGMENT_BITS - 7)) & 0x7F;
+}
+
+/*Bit i is set if control byte i of the group equals b*/
+static inline uint32_t group_match(const int8_t *group, int8_t b)
+{
+#ifdef __SSE2__
+    __m128i ctrl = _mm_load_si128((const __m128i *)group);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(b)));
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < GROUP_SIZE; i++)
+        mask |= (uint32_t)(group[i] == b) << i;
+    return mask;
+#endif
+}
+
+/*Empty and deleted are the only control bytes with the high bit set*/
+static inline uint32_t group_match_free(const int8_t *group)
+{
+#ifdef __SSE2__
+    return _mm_movemask_epi8(_mm_load_si128((const __m128i *)group));
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < GROUP_SIZE; i++)
+        mask |= (uint32_t)(group[i] < 0) << i;
+    return mask;
+#endif
+}
+
+static bool allocate_segment(swiss_segment_t *s, uint32_t capacity)
+{
+    /*Control bytes are loaded 16 at a time and have to be aligned*/
+    int8_t *ctrl = aligned_alloc(64, (capacity + 63) & ~63u);
+    swiss_slot_t *slots = malloc(sizeof(swiss_slot_t) * capacity);
+    if (ctrl == NULL || slots == NULL)
+    {
+        free(ctrl);
+        free(slots);
+        return false;
+    }
+    memset(ctrl, CTRL_EMPTY, capacity);
+    s->ctrl = ctrl;
+    s->slots = slots;
+    s->capacity = capacity;
+    s->size = 0;
+    s->tombstones = 0;
+    return true;
+}
+
+/*Groups are visited with triangular steps, which reaches every group
+  because the number of groups is a power of two*/
+static uint32_t find_free_slot(swiss_segment_t *s, uint64_t hash)
+{
+    uint32_t mask = s->capacity / GROUP_SIZE - 1;
+    uint32_t group = hash & mask;
+    for (uint32_t step = 1;; step++)
+    {
+        uint32_t m = group_match_free(s->ctrl + group * GROUP_SIZE);
+        if (m != 0)
+            return group * GROUP_SIZE + __builtin_ctz(m);
+        group = (group + step) & mask;
+    }
+}
+
+/*Returns the slot of key or -1*/
+static int64_t find_slot(swiss_segment_t *s, uint32_t key, uint64_t hash)
+{
+    uint32_t mask = s->capacity / GROUP_SIZE - 1;
+    uint32_t group = hash & mask;
+    int8_t tag = h2(hash);
+    for (uint32_t step = 1; step <= mask + 1; step++)
+    {
+        const int8_t *ctrl = s->ctrl + group * GROUP_SIZE;
+        for (uint32_t m = group_match(ctrl, tag); m != 0; m &= m - 1)
+        {
+            uint32_t i = group * GROUP_SIZE + __builtin_ctz(m);
+            if (s->slots[i].key == key)
+                return i;
+        }
+        /*A group with an empty slot ends every probe sequence passing it*/
+        if (group_match(ctrl, CTRL_EMPTY) != 0)
+            return -1;
+        group = (group + step) & mask;
+    }
+    return -1;
+}
+
+/*Rehashes the segment into a new array, which is doubled if at least
+  half of the slots are in use, otherwise only the tombstones are removed.
+  The lock of the segment has to be held for writing*/
+static bool resize_segment(swiss_segment_t *s)
+{
+    swiss_segment_t old = *s;
+    uint32_t capacity = old.size * 2 >= old.capacity ? old.capacity * 2 : old.capacity;
+    if (!allocate_segment(s, capacity))
+        return false;
+    for (uint32_t i = 0; i < old.capacity; i++)
+    {
+        if (old.ctrl[i] < 0)
+            continue;
+        uint64_t hash = hash_key(old.slots[i].key);
+        uint32_t n = find_free_slot(s, hash);
+        s->ctrl[n] = h2(hash);
+        s->slots[n] = old.slots[i];
+    }
+    s->size = old.size;
+    s->resizes = old.resizes + 1;
+    free(old.ctrl);
+    free(old.slots);
+    return true;
+}
+
+void *swiss_create(uint32_t size)
+{
+    swisstable_t *t = aligned_alloc(64, sizeof(swisstable_t));
+    if (t == NULL)
+        return NULL;
+    memset(t, 0, sizeof(swisstable_t));
+
+    /*size is the number of slots of the whole table*/
+    uint32_t capacity = MIN_CAPACITY;
+    while (capacity * SEGMENTS < size)
+        capacity *= 2;
+    for (int i = 0; i < SEGMENTS; i++)
+    {
+        pthread_rwlock_init(&t->segments[i].lock, NULL);
+        if (!allocate_segment(&t->segments[i], capacity))
+        {
+            for (int j = 0; j <= i; j++)
+            {
+                free(t->segments[j].ctrl);
+                free(t->segments[j].slots);
+                pthread_rwlock_destroy(&t->segments[j].lock);
+            }
+            free(t);
+            return NULL;
+        }
+    }
+    return t;
+}
+
+static bool insert_slot(swisstable_t *t, swiss_slot_t slot)
+{
+    uint32_t key = slot.key;
+    uint64_t hash = hash_key(key);
+    swiss_segment_t *s = &t->segments[segment_of(hash)];
+
+    pthread_rwlock_wrlock(&s->lock);
+    if ((uint64_t)(s->size + s->tombstones + 1) * MAX_LOAD_DEN > (uint64_t)s->capacity * MAX_LOAD_NUM)
+    {
+        if (!resize_segment(s) && s->size + s->tombstones == s->capacity)
+        {
+            pthread_rwlock_unlock(&s->lock);
+            fprintf(stderr, "Table segment is full, dropping key %u\n", key);
+            if (!is_inline(slot.length))
+                free(slot.obj);
+            return false;
+        }
+    }
+
+    uint32_t i = find_free_slot(s, hash);
+    if (s->ctrl[i] == CTRL_DELETED)
+        s->tombstones--;
+    s->ctrl[i] = h2(hash);
+    s->slots[i] = slot;
+    s->size++;
+    pthread_rwlock_unlock(&s->lock);
+    return true;
+}
+
+bool swiss_insert(void *table, uint32_t key, const void *data, uint32_t data_length)
+{
+    swiss_slot_t slot = {.key = key, .length = data_length};
+    if (is_inline(data_length))
+    {
+        memcpy(slot.data, data, data_length);
+    }
+    else
+    {
+        slot.obj = malloc(data_length);
+        if (slot.obj == NULL)
+        {
+            fprintf(stderr, "Could not allocate value, dropping key %u\n", key);
+            return false;
+        }
+        memcpy(slot.obj, data, data_length);
+    }
+    return insert_slot(table, slot);
+}
+
+bool swiss_insert_owned(void *table, uint32_t key, void *data, uint32_t data_length)
+{
+    swiss_slot_t slot = {.key = key, .length = data_length};
+    if (is_inline(data_length))
+    {
+        memcpy(slot.data, data, data_length);
+        free(data);
+    }
+    else
+    {
+        slot.obj = data;
+    }
+    return insert_slot(table, slot);
+}
+
+int64_t swiss_read(void *table, uint32_t key, uint32_t offset, void *dest, uint32_t capacity)
+{
+    swisstable_t *t = table;
+    uint64_t hash = hash_key(key);
+    swiss_segment_t *s = &t->segments[segment_of(hash)];
+
+    pthread_rwlock_rdlock(&s->lock);
+    int64_t i = find_slot(s, key, hash);
+    if (i < 0)
+    {
+        pthread_rwlock_unlock(&s->lock);
+        return -1;
+    }
+    uint32_t length = s->slots[i].length;
+    copy_range(dest, slot_value(&s->slots[i]), length, offset, capacity);
+    pthread_rwlock_unlock(&s->lock);
+    return length;
+}
+
+bool swiss_delete(void *table, uint32_t key)
+{
+    swisstable_t *t = table;
+    uint64_t hash = hash_key(key);
+    swiss_segment_t *s = &t->segments[segment_of(hash)];
+
+    pthread_rwlock_wrlock(&s->lock);
+    int64_t i = find_slot(s, key, hash);
+    if (i < 0)
+    {
+        pthread_rwlock_unlock(&s->lock);
+        return false;
+    }
+    if (!is_inline(s->slots[i].length))
+        free(s->slots[i].obj);
+    /*A slot can only become empty again if its group already has an empty slot,
+      otherwise probe sequences passing the group would end too early*/
+    const int8_t *group = s->ctrl + (i & ~(uint64_t)(GROUP_SIZE - 1));
+    if (group_match(group, CTRL_EMPTY) != 0)
+    {
+        s->ctrl[i] = CTRL_EMPTY;
+    }
+    else
+    {
+        s->ctrl[i] = CTRL_DELETED;
+        s->tombstones++;
+    }
+    s->size--;
+    pthread_rwlock_unlock(&s->lock);
+    return true;
+}
+
+uint64_t swiss_destroy(void *table)
+{
+    swisstable_t *t = table;
+    uint64_t count = 0;
+    for (int i = 0; i < SEGMENTS; i++)
+    {
+        swiss_segment_t *s = &t->segments[i];
+        for (uint32_t j = 0; j < s->capacity; j++)
+        {
+            if (s->ctrl[j] >= 0 && !is_inline(s->slots[j].length))
+                free(s->slots[j].obj);
+        }
+        count += s->size;
+        free(s->ctrl);
+        free(s->slots);
+        pthread_rwlock_destroy(&s->lock);
+    }
+    free(t);
+    return count;
+}
+
+void swiss_for_each(void *table, table_visit_t visit, void *ctx)
+{
+    swisstable_t *t = table;
+    for (int i = 0; i < SEGMENTS; i++)
+    {
+        swiss_segment_t *s = &t->segments[i];
+        pthread_rwlock_rdlock(&s->lock);
+        for (uint32_t j = 0; j < s->capacity; j++)
+        {
+            if (s->ctrl[j] >= 0)
+                visit(ctx, s->slots[j].key, slot_value(&s->slots[j]), s->slots[j].length);
+        }
+        pthread_rwlock_unlock(&s->lock);
+    }
+}
+
+void swiss_print_stats(void *table, FILE *f)
+{
+    swisstable_t *t = table;
+    uint64_t size = 0, capacity = 0, tombstones = 0, resizes = 0;
+    for (int i = 0; i < SEGMENTS; i++)
+    {
+        swiss_segment_t *s = &t->segments[i];
+        pthread_rwlock_rdlock(&s->lock);
+        size += s->size;
+        capacity += s->capacity;
+        tombstones += s->tombstones;
+        resizes += s->resizes;
+        pthread_rwlock_unlock(&s->lock);
+    }
+    fprintf(f, "Segments:             %d\n", SEGMENTS);
+    fprintf(f, "Slots:                %lu\n", capacity);
+    fprintf(f, "Entries:              %lu\n", size);
+    fprintf(f, "Deleted slots:        %lu\n", tombstones);
+    fprintf(f, "Load factor:          %.3f\n", capacity ? (double)size / capacity : 0.0);
+    fprintf(f, "Segment resizes:      %lu\n", resizes);
+}
+
+const table_engine_t swiss_engine = {
+    .name = "swiss",
+    .create = swiss_create,
+    .insert = swiss_insert,
+    .insert_owned = swiss_insert_owned,
+    .read = swiss_read,
+    .delete = swiss_delete,
+    .destroy = swiss_destroy,
+    .for_each = swiss_for_each,
+    .print_stats = swiss_print_stats,
+};
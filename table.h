@@ -0,0 +1,89 @@
+#ifndef TABLE_H
+#define TABLE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdatomic.h>
+
+/*Values up to this size are stored inside the table without a separate allocation*/
+#ifndef INLINE_VALUE_SIZE
+#define INLINE_VALUE_SIZE 48
+#endif
+
+static inline bool is_inline(uint32_t length)
+{
+    return length <= INLINE_VALUE_SIZE;
+}
+
+/*Copies the part of a value of length bytes starting at offset, at most capacity bytes*/
+static inline void copy_range(void *dest, const uint8_t *value, uint32_t length, uint32_t offset, uint32_t capacity)
+{
+    if (offset < length)
+        memcpy(dest, value + offset, length - offset < capacity ? length - offset : capacity);
+}
+
+/*Keys are often sequential, so the engines mix them before use (murmur3 finalizer)*/
+static inline uint64_t hash_key(uint32_t key)
+{
+    uint64_t h = key;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+/*Sequence numbers let readers see data without its lock: a writer makes the number odd
+  while it changes the data, a reader retries if it was odd or changed while it read*/
+static inline void begin_write(_Atomic uint32_t *seq)
+{
+    atomic_store_explicit(seq, atomic_load_explicit(seq, memory_order_relaxed) + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+static inline void end_write(_Atomic uint32_t *seq)
+{
+    atomic_store_explicit(seq, atomic_load_explicit(seq, memory_order_relaxed) + 1, memory_order_release);
+}
+
+/*Called by for_each for every entry*/
+typedef void (*table_visit_t)(void *ctx, uint32_t key, const void *value, uint32_t length);
+
+/*Operations of a hash table implementation,
+  the server only uses the table through one of these.
+  A key can have several entries: insert adds one even if the key is in the table,
+  read and delete use the same one of them*/
+typedef struct table_engine
+{
+    const char *name;
+    void *(*create)(uint32_t size);
+    /*The table keeps its own copy of data. Returns false if the entry was dropped,
+      e.g. because memory ran out*/
+    bool (*insert)(void *t, uint32_t key, const void *data, uint32_t data_length);
+    /*Like insert, but takes over data, which has to be allocated with malloc.
+      A dropped entry frees data as well*/
+    bool (*insert_owned)(void *t, uint32_t key, void *data, uint32_t data_length);
+    /*Copies the value of key from offset on into dest, which holds capacity bytes.
+      Returns the length of the whole value or -1 if key is not in the table*/
+    int64_t (*read)(void *t, uint32_t key, uint32_t offset, void *dest, uint32_t capacity);
+    /*Returns false if key is not in the table*/
+    bool (*delete)(void *t, uint32_t key);
+    /*Frees the table with all values, returns the number of entries left*/
+    uint64_t (*destroy)(void *t);
+    /*Calls visit for every entry. An entry that is changed meanwhile
+      is visited with its old or new value or not at all*/
+    void (*for_each)(void *t, table_visit_t visit, void *ctx);
+    void (*print_stats)(void *t, FILE *f);
+} table_engine_t;
+
+/*Buckets with chains of entries*/
+extern const table_engine_t chain_engine;
+/*Open addressing with SIMD probed control bytes*/
+extern const table_engine_t swiss_engine;
+/*Open addressing in a shared memory segment the clients read from*/
+extern const table_engine_t shared_engine;
+
+#endif
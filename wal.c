@@ -0,0 +1,451 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "wal.h"
+#ifdef USECUSTOMMALLOC
+#include "alloc.h"
+#endif
+
+/*Changes of one key are applied and logged in the same order under one of these locks*/
+#define WAL_LOCKS 256
+/*Seconds the flusher waits before it tries a failed write again*/
+#define WAL_RETRY_INTERVAL 1
+#define WAL_MIN_BUFFER (64 * 1024)
+
+/*Records are padded to 8 bytes, checksum covers the record with checksum 0 and its padding*/
+typedef struct wal_record
+{
+    uint64_t sequence;
+    uint32_t type;
+    uint32_t key;
+    uint32_t length;
+    uint32_t checksum;
+    uint8_t data[];
+} wal_record_t;
+
+#define RECORD_SIZE(length) ((sizeof(wal_record_t) + (uint64_t)(length) + 7) & ~(uint64_t)7)
+
+struct wal
+{
+    int fd;
+    /*Guards the buffer and the counters*/
+    pthread_mutex_t lock;
+    /*The flusher waits for records*/
+    pthread_cond_t filled;
+    /*Committing threads wait for durable*/
+    pthread_cond_t flushed;
+    uint8_t *buffer;
+    size_t used;
+    size_t allocated;
+    /*The flusher writes this one while the other is filled*/
+    uint8_t *spare;
+    size_t spare_allocated;
+    uint64_t appended;
+    _Atomic uint64_t durable;
+    uint32_t commit_us;
+    uint32_t commit_bytes;
+    bool running;
+    pthread_t flusher;
+    /*Held while a batch is written or the log is truncated*/
+    pthread_mutex_t io_lock;
+    /*Read locked by every writer, write locked while a snapshot is written*/
+    pthread_rwlock_t writers;
+    pthread_mutex_t locks[WAL_LOCKS];
+    uint64_t batches;
+    uint64_t written;
+};
+
+typedef struct logged_table
+{
+    wal_t *w;
+    const table_engine_t *base;
+    void *table;
+} logged_table_t;
+
+/*Number of the last record the thread appended*/
+static __thread uint64_t thread_sequence = 0;
+
+/*FNV-1a*/
+static uint32_t checksum(const uint8_t *data, uint64_t length)
+{
+    uint32_t h = 2166136261u;
+    for (uint64_t i = 0; i < length; i++)
+        h = (h ^ data[i]) * 16777619u;
+    return h;
+}
+
+int64_t wal_replay(const char *path, uint64_t after, wal_apply_t apply, void *ctx, uint64_t *last)
+{
+    *last = 0;
+    int fd = open(path, O_RDWR);
+    if (fd < 0)
+        return errno == ENOENT ? 0 : -1;
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    FILE *f = fdopen(fd, "r");
+    int64_t applied = 0;
+    uint64_t valid = 0;
+    bool failed = false;
+    size_t allocated = 0;
+    wal_record_t *r = NULL;
+    wal_record_t h;
+    while (fread(&h, sizeof(h), 1, f) == 1)
+    {
+        uint64_t size = RECORD_SIZE(h.length);
+        if (size > (uint64_t)st.st_size - valid)
+            break;
+        if (size > allocated)
+        {
+            wal_record_t *grown = realloc(r, size);
+            if (grown == NULL)
+            {
+                failed = true;
+                break;
+            }
+            r = grown;
+            allocated = size;
+        }
+        *r = h;
+        r->checksum = 0;
+        if (size > sizeof(h) && fread(r->data, size - sizeof(h), 1, f) != 1)
+            break;
+        if (checksum((uint8_t *)r, size) != h.checksum || (h.type != WAL_INSERT && h.type != WAL_DELETE))
+            break;
+        if (h.sequence > after)
+        {
+            apply(ctx, h.type, h.key, r->data, h.length);
+            applied++;
+        }
+        *last = h.sequence;
+        valid += size;
+    }
+    free(r);
+    /*Records after a torn one were never acknowledged. The ones that could not be read
+      may have been, so the log is left as it is*/
+    if (failed || ferror(f))
+        applied = -1;
+    else if (ftruncate(fd, valid) != 0)
+        applied = -1;
+    fclose(f);
+    return applied;
+}
+
+static void write_batch(wal_t *w, const uint8_t *data, size_t length)
+{
+    size_t done = 0;
+    while (done < length)
+    {
+        ssize_t n = write(w->fd, data + done, length - done);
+        if (n < 0 && errno != EINTR)
+        {
+            fprintf(stderr, "Failed to write the log: %s\n", strerror(errno));
+            sleep(WAL_RETRY_INTERVAL);
+        }
+        done += n > 0 ? n : 0;
+    }
+    /*The kernel may drop the pages it could not write, a later sync would succeed without them*/
+    if (fdatasync(w->fd) != 0)
+    {
+        fprintf(stderr, "Failed to sync the log: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*Writes everything appended since the last batch, a batch is started by its first record
+  and waits commit_us for more records unless it reaches commit_bytes before*/
+static void *flush_function(void *args)
+{
+    wal_t *w = args;
+    pthread_mutex_lock(&w->lock);
+    for (;;)
+    {
+        while (w->used == 0 && w->running)
+            pthread_cond_wait(&w->filled, &w->lock);
+        if (w->used == 0)
+            break;
+        if (w->commit_us > 0 && w->used < w->commit_bytes && w->running)
+        {
+            struct timespec deadline;
+            clock_gettime(CLOCK_MONOTONIC, &deadline);
+            deadline.tv_nsec += (long)w->commit_us * 1000;
+            deadline.tv_sec += deadline.tv_nsec / 1000000000;
+            deadline.tv_nsec %= 1000000000;
+            while (w->used < w->commit_bytes && w->running &&
+                   pthread_cond_timedwait(&w->filled, &w->lock, &deadline) != ETIMEDOUT)
+                ;
+        }
+        uint8_t *batch = w->buffer;
+        size_t length = w->used, allocated = w->allocated;
+        uint64_t last = w->appended;
+        w->buffer = w->spare;
+        w->allocated = w->spare_allocated;
+        w->spare = batch;
+        w->spare_allocated = allocated;
+        w->used = 0;
+        pthread_mutex_unlock(&w->lock);
+
+        pthread_mutex_lock(&w->io_lock);
+        write_batch(w, batch, length);
+        pthread_mutex_unlock(&w->io_lock);
+
+        pthread_mutex_lock(&w->lock);
+        if (last > atomic_load(&w->durable))
+            atomic_store(&w->durable, last);
+        w->batches++;
+        w->written += length;
+        pthread_cond_broadcast(&w->flushed);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+wal_t *wal_open(const char *path, uint64_t sequence, uint32_t commit_us, uint32_t commit_bytes)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0)
+        return NULL;
+    wal_t *w = calloc(1, sizeof(wal_t));
+    if (w == NULL)
+    {
+        close(fd);
+        return NULL;
+    }
+    w->fd = fd;
+    w->appended = sequence;
+    w->durable = sequence;
+    w->commit_us = commit_us;
+    w->commit_bytes = commit_bytes;
+    w->running = true;
+    w->allocated = w->spare_allocated = WAL_MIN_BUFFER;
+    w->buffer = malloc(w->allocated);
+    w->spare = malloc(w->spare_allocated);
+    if (w->buffer == NULL || w->spare == NULL)
+    {
+        free(w->buffer);
+        free(w->spare);
+        free(w);
+        close(fd);
+        return NULL;
+    }
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_mutex_init(&w->io_lock, NULL);
+    pthread_condattr_t condattr;
+    pthread_condattr_init(&condattr);
+    pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
+    pthread_cond_init(&w->filled, &condattr);
+    pthread_cond_init(&w->flushed, NULL);
+    pthread_condattr_destroy(&condattr);
+    /*A snapshot is not starved by a steady stream of writers*/
+    pthread_rwlockattr_t rwattr;
+    pthread_rwlockattr_init(&rwattr);
+    pthread_rwlockattr_setkind_np(&rwattr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&w->writers, &rwattr);
+    pthread_rwlockattr_destroy(&rwattr);
+    for (int i = 0; i < WAL_LOCKS; i++)
+        pthread_mutex_init(&w->locks[i], NULL);
+    pthread_create(&w->flusher, NULL, flush_function, w);
+    return w;
+}
+
+static void append(wal_t *w, uint32_t type, uint32_t key, const void *data, uint32_t length)
+{
+    uint64_t size = RECORD_SIZE(length);
+    pthread_mutex_lock(&w->lock);
+    if (w->used + size > w->allocated)
+    {
+        size_t allocated = w->allocated * 2 > w->used + size ? w->allocated * 2 : w->used + size;
+        uint8_t *grown = realloc(w->buffer, allocated);
+        if (grown == NULL)
+        {
+            fprintf(stderr, "Could not grow the log buffer\n");
+            exit(EXIT_FAILURE);
+        }
+        w->buffer = grown;
+        w->allocated = allocated;
+    }
+    wal_record_t *r = (wal_record_t *)(w->buffer + w->used);
+    *r = (wal_record_t){.sequence = ++w->appended, .type = type, .key = key, .length = length, .checksum = 0};
+    if (length > 0)
+        memcpy(r->data, data, length);
+    memset(r->data + length, 0, size - sizeof(wal_record_t) - length);
+    r->checksum = checksum((uint8_t *)r, size);
+    thread_sequence = r->sequence;
+    /*The flusher waits for the first record of a batch and for a full batch*/
+    bool wake = w->used == 0 || (w->used < w->commit_bytes && w->used + size >= w->commit_bytes);
+    w->used += size;
+    if (wake)
+        pthread_cond_signal(&w->filled);
+    pthread_mutex_unlock(&w->lock);
+}
+
+void wal_commit(wal_t *w)
+{
+    uint64_t sequence = thread_sequence;
+    if (atomic_load(&w->durable) >= sequence)
+        return;
+    pthread_mutex_lock(&w->lock);
+    while (atomic_load(&w->durable) < sequence)
+        pthread_cond_wait(&w->flushed, &w->lock);
+    pthread_mutex_unlock(&w->lock);
+}
+
+uint64_t wal_pause(wal_t *w)
+{
+    pthread_rwlock_wrlock(&w->writers);
+    pthread_mutex_lock(&w->lock);
+    uint64_t sequence = w->appended;
+    pthread_mutex_unlock(&w->lock);
+    return sequence;
+}
+
+/*A batch the flusher writes after the truncation only holds records up to sequence,
+  which a replay after the snapshot skips*/
+void wal_resume(wal_t *w, uint64_t sequence, bool truncate)
+{
+    if (truncate)
+    {
+        pthread_mutex_lock(&w->io_lock);
+        pthread_mutex_lock(&w->lock);
+        w->used = 0;
+        if (ftruncate(w->fd, 0) != 0 || fdatasync(w->fd) != 0)
+            fprintf(stderr, "Failed to truncate the log: %s\n", strerror(errno));
+        if (sequence > atomic_load(&w->durable))
+            atomic_store(&w->durable, sequence);
+        pthread_cond_broadcast(&w->flushed);
+        pthread_mutex_unlock(&w->lock);
+        pthread_mutex_unlock(&w->io_lock);
+    }
+    pthread_rwlock_unlock(&w->writers);
+}
+
+void wal_close(wal_t *w)
+{
+    pthread_mutex_lock(&w->lock);
+    w->running = false;
+    pthread_cond_signal(&w->filled);
+    pthread_mutex_unlock(&w->lock);
+    pthread_join(w->flusher, NULL);
+    close(w->fd);
+    pthread_mutex_destroy(&w->lock);
+    pthread_mutex_destroy(&w->io_lock);
+    pthread_cond_destroy(&w->filled);
+    pthread_cond_destroy(&w->flushed);
+    pthread_rwlock_destroy(&w->writers);
+    for (int i = 0; i < WAL_LOCKS; i++)
+        pthread_mutex_destroy(&w->locks[i]);
+    free(w->buffer);
+    free(w->spare);
+    free(w);
+}
+
+void *wal_wrap(wal_t *w, const table_engine_t *base, void *table)
+{
+    logged_table_t *t = malloc(sizeof(logged_table_t));
+    if (t == NULL)
+        return NULL;
+    *t = (logged_table_t){.w = w, .base = base, .table = table};
+    return t;
+}
+
+static void lock_key(wal_t *w, uint32_t key)
+{
+    pthread_rwlock_rdlock(&w->writers);
+    pthread_mutex_lock(&w->locks[key % WAL_LOCKS]);
+}
+
+static void unlock_key(wal_t *w, uint32_t key)
+{
+    pthread_mutex_unlock(&w->locks[key % WAL_LOCKS]);
+    pthread_rwlock_unlock(&w->writers);
+}
+
+static bool logged_insert(void *table, uint32_t key, const void *data, uint32_t data_length)
+{
+    logged_table_t *t = table;
+    lock_key(t->w, key);
+    append(t->w, WAL_INSERT, key, data, data_length);
+    bool inserted = t->base->insert(t->table, key, data, data_length);
+    unlock_key(t->w, key);
+    return inserted;
+}
+
+static bool logged_insert_owned(void *table, uint32_t key, void *data, uint32_t data_length)
+{
+    logged_table_t *t = table;
+    lock_key(t->w, key);
+    append(t->w, WAL_INSERT, key, data, data_length);
+    bool inserted = t->base->insert_owned(t->table, key, data, data_length);
+    unlock_key(t->w, key);
+    return inserted;
+}
+
+static int64_t logged_read(void *table, uint32_t key, uint32_t offset, void *dest, uint32_t capacity)
+{
+    logged_table_t *t = table;
+    return t->base->read(t->table, key, offset, dest, capacity);
+}
+
+/*Only a delete that removed something is logged*/
+static bool logged_delete(void *table, uint32_t key)
+{
+    logged_table_t *t = table;
+    lock_key(t->w, key);
+    bool found = t->base->delete(t->table, key);
+    if (found)
+        append(t->w, WAL_DELETE, key, NULL, 0);
+    unlock_key(t->w, key);
+    return found;
+}
+
+static uint64_t logged_destroy(void *table)
+{
+    logged_table_t *t = table;
+    uint64_t count = t->base->destroy(t->table);
+    free(t);
+    return count;
+}
+
+static void logged_for_each(void *table, table_visit_t visit, void *ctx)
+{
+    logged_table_t *t = table;
+    t->base->for_each(t->table, visit, ctx);
+}
+
+static void logged_print_stats(void *table, FILE *f)
+{
+    logged_table_t *t = table;
+    wal_t *w = t->w;
+    t->base->print_stats(t->table, f);
+    pthread_mutex_lock(&w->lock);
+    fprintf(f, "Log records:          %lu (%lu durable)\n", w->appended, atomic_load(&w->durable));
+    fprintf(f, "Log batches:          %lu\n", w->batches);
+    fprintf(f, "Avg. batch size:      %.0f bytes\n", w->batches ? (double)w->written / w->batches : 0.0);
+    pthread_mutex_unlock(&w->lock);
+}
+
+/*Tables of this engine are only made by wal_wrap*/
+const table_engine_t wal_engine = {
+    .name = "wal",
+    .create = NULL,
+    .insert = logged_insert,
+    .insert_owned = logged_insert_owned,
+    .read = logged_read,
+    .delete = logged_delete,
+    .destroy = logged_destroy,
+    .for_each = logged_for_each,
+    .print_stats = logged_print_stats,
+};
@@ -0,0 +1,52 @@
+#ifndef WAL_H
+#define WAL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "table.h"
+
+/*
+Write ahead log of the inserts and deletes. The server threads append records to a
+buffer in memory, a flusher thread writes everything appended meanwhile with one
+write and fdatasync (group commit). A thread answers its client only once its own
+records are durable, see wal_commit. Every record has a sequence number, a snapshot
+stores the number of the last record it contains, so only later records are replayed.
+*/
+
+#define WAL_INSERT 1
+#define WAL_DELETE 2
+
+typedef struct wal wal_t;
+
+/*Applies a record during the replay*/
+typedef void (*wal_apply_t)(void *ctx, uint32_t type, uint32_t key, const void *data, uint32_t length);
+
+/*Applies the records of the log at path with a sequence number above after. A damaged
+  or torn tail is cut off. Sets *last to the number of the last record in the log and
+  returns the number of records applied, -1 if the log cannot be read, which leaves it as it is*/
+int64_t wal_replay(const char *path, uint64_t after, wal_apply_t apply, void *ctx, uint64_t *last);
+
+/*Opens the log at path for appending, the next record gets number sequence + 1.
+  A batch is written commit_us microseconds after its first record or once it holds
+  commit_bytes bytes. The process exits if a batch cannot be synced*/
+wal_t *wal_open(const char *path, uint64_t sequence, uint32_t commit_us, uint32_t commit_bytes);
+
+/*Waits until every record the calling thread appended is durable*/
+void wal_commit(wal_t *w);
+
+/*Blocks all writers through wal_engine, returns the number of the last record appended*/
+uint64_t wal_pause(wal_t *w);
+
+/*Drops the records up to sequence, which are in a snapshot now, and lets the writers go on*/
+void wal_resume(wal_t *w, uint64_t sequence, bool truncate);
+
+/*Wraps table, which uses base, in a table of wal_engine that logs every change, NULL on failure*/
+void *wal_wrap(wal_t *w, const table_engine_t *base, void *table);
+
+/*Logs the inserts and deletes of a table of another engine*/
+extern const table_engine_t wal_engine;
+
+/*Writes the records left and closes the log, the wrapped tables have to be destroyed first*/
+void wal_close(wal_t *w);
+
+#endif